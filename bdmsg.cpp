@@ -22,7 +22,7 @@ static map<string, void (Core::*)(const Msg&)> bdm_list = {
 
 void Core::before_delete_message(const Msg& msg)
 {
-	string msgstr = msg.value["name"].asString();
+	const string& msgstr = msg.name;
 	auto p = bdm_list.find(msgstr);
 	if (p != bdm_list.end())
 		try {
@@ -34,25 +34,27 @@ void Core::before_delete_message(const Msg& msg)
 
 void Core::bdm_delfile(const Msg& msg)
 {
-	const Json::Value& jfn = msg.value["filename"];
+	const Json::Value& jfn = msg.value()["filename"];
 	string fn = jfn.asString();
 	string filename = cfg.filesdir() + '/' + fn;
 	fs::remove(filename);
 	auto p = find(filenames.begin(), filenames.end(), fn);
-	if (p != filenames.end())
+	if (p != filenames.end()) {
 		filenames.erase(p);
+		filenames_changed = true;
+	}
 }
 
 void Core::bdm_deldir(const Msg& msg)
 {
-	string dn = msg.value["dirname"].asString();
+	string dn = msg.value()["dirname"].asString();
 	string dirname = cfg.filesdir() + '/' + dn;
 	fs::remove_all(dirname);
 }
 
 void Core::bdm_delnode(const Msg& msg)
 {
-	UUID id = msg.value["val"];
+	UUID id = msg.value()["val"];
 	if (!id || (id == my_id && nodes.size() > 1))
 		return;
 
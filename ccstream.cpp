@@ -3,6 +3,7 @@
 #include <libintl.h>
 #include <iostream>
 #include <cassert>
+#include <cmath>
 #include <error.h>
 #include "utils.h"
 #include "main.h"
@@ -15,6 +16,7 @@ using std::copy;
 using std::cout;
 using std::endl;
 using std::string;
+using std::vector;
 using std::min;
 using std::exception;
 using std::istringstream;
@@ -236,8 +238,10 @@ void Ostream::write(const void * from, size_t size)
 			src_ptr += msize;
 		}
 	} else {
-		flush_cache();
-		writefile(base.fd, from, size, base.filename);
+		// Cache and data by one system call
+		iovec iov[2] = {{cache, size_t(ptr - cache)}, {(void *)from, size}};
+		writevfile(base.fd, iov, 2, base.filename);
+		ptr = cache;
 	}
 }
 
@@ -257,7 +261,6 @@ void Ostream::flush_net()
 	if (!base.net)
 		return;
 	flush_cache();
-	fsync(base.fd);
 }
 
 off_t Ostream::tell()
@@ -276,18 +279,53 @@ void Ostream::close()
 	ptr = nullptr;
 }
 
+// ===== Records (StreamCipher::gcm) =====
+
+static const size_t record_size = 0x10000; // max size of data in record
+static const size_t record_tag_size = 16;
+
+static gnutls_aead_cipher_hd_t record_cipher_init(const CryptKey& key)
+{
+	// Key differs from one of AES-CFB8 streams
+	unsigned char rkey[32];
+	static const char label[] = "distadm records";
+	int res = gnutls_hmac_fast(GNUTLS_MAC_SHA256, &key, sizeof(key), label, sizeof(label) - 1, rkey);
+	if (res < 0)
+		error(1, 0, "GNU TLS error %s", gnutls_strerror(res));
+	gnutls_datum_t key_d;
+	key_d.data = rkey;
+	key_d.size = sizeof(rkey);
+	gnutls_aead_cipher_hd_t res_ctx;
+	res = gnutls_aead_cipher_init(&res_ctx, GNUTLS_CIPHER_AES_256_GCM, &key_d);
+	if (res < 0)
+		error(1, 0, "GNU TLS error %s", gnutls_strerror(res));
+	return res_ctx;
+}
+
+// Nonce of record: random nonce of stream xor number of record
+static void record_nonce(unsigned char (&res)[12], const Nonce& nonce, uint64_t n)
+{
+	memcpy(res, &nonce, sizeof(res));
+	for (size_t i = 0; i < sizeof(n); i++)
+		res[4 + i] ^= n >> (i * 8);
+}
+
 // ===== ICstream =====
 
-ICstream::ICstream(Istream& b, const CryptKey& key) :
-	base(b)
+ICstream::ICstream(Istream& b, const CryptKey& key, StreamCipher c) :
+	base(b),
+	cipher(c)
 {
-	Nonce nonce;
 	base.read(&nonce, sizeof(nonce));
-	init(key, nonce);
+	if (cipher == StreamCipher::gcm)
+		actx = record_cipher_init(key);
+	else
+		init(key, nonce);
 }
 
 ICstream::ICstream(Istream& b, const CryptKey& key, const Nonce& nonce) :
-	base(b)
+	base(b),
+	cipher(StreamCipher::cfb8)
 {
 	init(key, nonce);
 }
@@ -314,6 +352,10 @@ void ICstream::init(const CryptKey& key, const Nonce& nonce)
 
 ICstream::~ICstream()
 {
+	if (actx) {
+		gnutls_aead_cipher_deinit(actx);
+		actx = nullptr;
+	}
 	if (!cctx)
 		return;
 	gnutls_cipher_deinit(cctx);
@@ -323,13 +365,19 @@ ICstream::~ICstream()
 void ICstream::read(void * buf, size_t size)
 {
 	read_nh(buf, size);
-	SHA1Update(&sctx, (const uint8_t *)buf, size);
+	if (cipher == StreamCipher::cfb8)
+		SHA1Update(&sctx, (const uint8_t *)buf, size);
 }
 
 void ICstream::read_nh(void * buf, size_t size)
 {
 	char * dst = (char *) buf;
 	char * const dst_end = dst + size;
+	if (cipher == StreamCipher::gcm) {
+		while (dst < dst_end)
+			dst += read_some(dst, dst_end - dst);
+		return;
+	}
 	while (dst < dst_end) {
 		if (base.ptr == base.cache_end)
 			base.fillcache();
@@ -344,8 +392,57 @@ void ICstream::read_nh(void * buf, size_t size)
 	}
 }
 
+size_t ICstream::read_some(void * buf, size_t size)
+{
+	if (cipher == StreamCipher::gcm) {
+		while (record_pos == record.size())
+			read_record();
+		size = min(size, record.size() - record_pos);
+		memcpy(buf, record.data() + record_pos, size);
+		record_pos += size;
+		return size;
+	}
+	if (base.ptr == base.cache_end)
+		base.fillcache();
+	size = min(size, size_t(base.cache_end - base.ptr));
+	read_nh(buf, size);
+	return size;
+}
+
+void ICstream::unread(size_t size)
+{
+	if (cipher == StreamCipher::gcm) {
+		assert(record_pos >= size);
+		record_pos -= size;
+		return;
+	}
+	base.ptr -= size;
+	assert(base.ptr >= base.cache);
+}
+
+void ICstream::read_record()
+{
+	uint32_t size;
+	base.read(&size, sizeof(size));
+	if (size > record_size)
+		throw exc_error(_("Damaged file"), base.base.filename);
+	sealed.resize(size + record_tag_size);
+	base.read(sealed.data(), sealed.size());
+	record.resize(size);
+	record_pos = 0;
+	unsigned char rnonce[12];
+	record_nonce(rnonce, nonce, records++);
+	size_t len = size;
+	int ret = gnutls_aead_cipher_decrypt(actx, rnonce, sizeof(rnonce), &size, sizeof(size),
+		record_tag_size, sealed.data(), sealed.size(), record.data(), &len);
+	if (ret < 0 || len != size)
+		throw exc_error(_("Damaged file"), base.base.filename);
+}
+
 void ICstream::check_hash()
 {
+	if (cipher == StreamCipher::gcm)
+		return;
 	char buf1[SHA1_DIGEST_LENGTH];
 	SHA1Final((uint8_t *)buf1, &sctx);
 	SHA1Init(&sctx);
@@ -358,18 +455,21 @@ void ICstream::check_hash()
 
 // ===== OCstream =====
 
-OCstream::OCstream(Ostream& b, const CryptKey& key) :
-	base(b)
+OCstream::OCstream(Ostream& b, const CryptKey& key, StreamCipher c) :
+	base(b),
+	cipher(c)
 {
-	Nonce nonce;
 	nonce.random(rnd);
 	base.write(&nonce, sizeof(nonce));
-	init(key, nonce);
-	base.flush_net();
+	if (cipher == StreamCipher::gcm)
+		actx = record_cipher_init(key);
+	else
+		init(key, nonce);
 }
 
 OCstream::OCstream(Ostream& b, const CryptKey& key, const Nonce& nonce) :
-	base(b)
+	base(b),
+	cipher(StreamCipher::cfb8)
 {
 	init(key, nonce);
 }
@@ -397,6 +497,10 @@ void OCstream::init(const CryptKey& key, const Nonce& nonce)
 
 OCstream::~OCstream()
 {
+	if (actx) {
+		gnutls_aead_cipher_deinit(actx);
+		actx = nullptr;
+	}
 	if (!cctx)
 		return;
 	gnutls_cipher_deinit(cctx);
@@ -406,13 +510,24 @@ OCstream::~OCstream()
 void OCstream::write(const void * data, size_t size)
 {
 	write_nc(data, size);
-	SHA1Update(&sctx, (const uint8_t *)data, size);
+	if (cipher == StreamCipher::cfb8)
+		SHA1Update(&sctx, (const uint8_t *)data, size);
 }
 
 void OCstream::write_nc(const void * data, size_t size)
 {
 	const char * src = (const char *) data;
 	const char * const src_end = src + size;
+	if (cipher == StreamCipher::gcm) {
+		while (src < src_end) {
+			size_t csize = min(size_t(src_end - src), record_size - record.size());
+			record.insert(record.end(), src, src + csize);
+			src += csize;
+			if (record.size() == record_size)
+				flush();
+		}
+		return;
+	}
 	while (src < src_end) {
 		if (base.ptr == base.dst_end)
 			base.flush_cache();
@@ -429,6 +544,8 @@ void OCstream::write_nc(const void * data, size_t size)
 
 void OCstream::write_hash()
 {
+	if (cipher == StreamCipher::gcm)
+		return;
 	char buf[SHA1_DIGEST_LENGTH];
 	SHA1Final((uint8_t *)buf, &sctx);
 	SHA1Init(&sctx);
@@ -436,10 +553,28 @@ void OCstream::write_hash()
 	write_nc(&buf, sizeof(buf));
 }
 
+void OCstream::flush()
+{
+	if (record.empty())
+		return;
+	uint32_t size = record.size();
+	unsigned char rnonce[12];
+	record_nonce(rnonce, nonce, records++);
+	sealed.resize(size + record_tag_size);
+	size_t len = sealed.size();
+	int ret = gnutls_aead_cipher_encrypt(actx, rnonce, sizeof(rnonce), &size, sizeof(size),
+		record_tag_size, record.data(), size, sealed.data(), &len);
+	if (ret < 0)
+		error(1, 0, "GNU TLS error %s", gnutls_strerror(ret));
+	base.write(&size, sizeof(size));
+	base.write(sealed.data(), len);
+	record.clear();
+}
+
 // ===== ICCstream =====
 
-ICCstream::ICCstream(Istream& b, const CryptKey& key) :
-	ICstream(b, key)
+ICCstream::ICCstream(Istream& b, const CryptKey& key, StreamCipher c) :
+	ICstream(b, key, c)
 {
 	ptr = cache;
 	cache_end = cache;
@@ -462,12 +597,7 @@ void ICCstream::fillcache()
 {
 	assert(cache_end == ptr);
 	ptr = cache;
-	cache_end = cache;
-	if (base.cache_end == base.ptr)
-		base.fillcache();
-	ssize_t rsize = min(base.cache_end - base.ptr, (ssize_t)sizeof(cache));
-	ICstream::read_nh(cache, rsize);
-	cache_end = cache + rsize;
+	cache_end = cache + read_some(cache, sizeof(cache));
 }
 
 ICCstream::~ICCstream()
@@ -509,15 +639,15 @@ void ICCstream::close()
 	if (err != Z_OK)
 		error(1, 0, "Zlib error");
 
-	base.ptr -= cache_end - ptr;
-	assert(base.ptr >= base.cache);
+	unread(cache_end - ptr);
 	initialized = false;
 }
 
 void ICCstream::read(void * buf, size_t size)
 {
 	read_nc(buf, size);
-	SHA1Update(&sctx, (const uint8_t *)buf, size);
+	if (cipher == StreamCipher::cfb8)
+		SHA1Update(&sctx, (const uint8_t *)buf, size);
 }
 
 void ICCstream::read_nc(void * buf, size_t size)
@@ -546,6 +676,13 @@ void ICCstream::read_nc(void * buf, size_t size)
 }
 
 Json::Value ICCstream::read_json()
+{
+	Json::Value res;
+	istringstream(read_string()) >> res;
+	return res;
+}
+
+string ICCstream::read_string()
 {
 	size_t size;
 	read(&size, sizeof(size));
@@ -554,9 +691,7 @@ Json::Value ICCstream::read_json()
 	str.resize(size);
 	read(str.data(), size);
 	check_hash();
-	Json::Value res;
-	istringstream(str) >> res;
-	return res;
+	return str;
 }
 
 void ICCstream::read_to_tempfile(int fd)
@@ -605,6 +740,8 @@ void ICCstream::skip_file()
 
 void ICCstream::check_hash()
 {
+	if (cipher == StreamCipher::gcm)
+		return;
 	char buf1[SHA1_DIGEST_LENGTH];
 	SHA1Final((uint8_t *)buf1, &sctx);
 	SHA1Init(&sctx);
@@ -617,8 +754,8 @@ void ICCstream::check_hash()
 
 // ===== OCCstream =====
 
-OCCstream::OCCstream(Ostream& b, const CryptKey& key) :
-	OCstream(b, key)
+OCCstream::OCCstream(Ostream& b, const CryptKey& key, StreamCipher c) :
+	OCstream(b, key, c)
 {
 	zctx.zalloc = nullptr;
 	zctx.zfree = nullptr;
@@ -645,7 +782,8 @@ OCCstream::~OCCstream()
 void OCCstream::write(const void * from, size_t size)
 {
 	write_nc(from, size);
-	SHA1Update(&sctx, (const uint8_t *)from, size);
+	if (cipher == StreamCipher::cfb8)
+		SHA1Update(&sctx, (const uint8_t *)from, size);
 }
 
 void OCCstream::write_nc(const void * from, size_t size)
@@ -692,6 +830,7 @@ void OCCstream::close()
 	if (err != Z_OK)
 		error(1, 0, "Zlib error");
 	initialized = false;
+	OCstream::flush();
 	base.flush_net();
 }
 
@@ -703,20 +842,28 @@ void OCCstream::flush_net()
 	assert(sizeof(buf) <= UINT_MAX);
 	zctx.next_in = nullptr;
 	zctx.avail_in = 0;
-	zctx.next_out = buf;
-	zctx.avail_out = sizeof(buf);
-	int err = deflate(&zctx, Z_SYNC_FLUSH);
-	if (err != Z_OK)
-		error(1, 0, "Zlib deflate error %s", zctx.msg);
-	size_t s = zctx.next_out - buf;
-	//dump("Comp:", buf, s);
-	OCstream::write_nc(buf, s);
+	// Pending output may be greater than buffer when much data was written
+	do {
+		zctx.next_out = buf;
+		zctx.avail_out = sizeof(buf);
+		int err = deflate(&zctx, Z_SYNC_FLUSH);
+		if (err != Z_OK && err != Z_BUF_ERROR)
+			error(1, 0, "Zlib deflate error %s", zctx.msg);
+		size_t s = zctx.next_out - buf;
+		//dump("Comp:", buf, s);
+		OCstream::write_nc(buf, s);
+	} while (!zctx.avail_out);
+	OCstream::flush();
 	base.flush_net();
 }
 
 void OCCstream::write_json(const Json::Value& json)
 {
-	string str = compact_string(json);
+	write_string(compact_string(json));
+}
+
+void OCCstream::write_string(const string& str)
+{
 	size_t size = str.size();
 	write(&size, sizeof(size));
 	write_hash();
@@ -724,6 +871,26 @@ void OCCstream::write_json(const Json::Value& json)
 	write_hash();
 }
 
+// Deflate is slow and useless for already compressed data (archives, media)
+static const size_t probe_interval = 16; // blocks between checks while compressing
+static const ssize_t probe_size = 0x2000;
+
+/* Data is checked by entropy of its bytes: compressed data has nearly 8 bits
+ * per byte. It is much cheaper than test deflate, so every block of stored
+ * data may be checked */
+static bool compressible(const char * data, size_t size)
+{
+	size_t cnt[256] = {};
+	for (size_t i = 0; i < size; i++)
+		cnt[(unsigned char)data[i]]++;
+	double sum = 0;
+	for (size_t c : cnt)
+		if (c)
+			sum += c * log2(c);
+	double entropy = log2(size) - sum / size; // bits per byte
+	return entropy < 7.5;
+}
+
 void OCCstream::write_file(int fd, const string& fname, off_t from, off_t to)
 {
 	char buf[0x10000];
@@ -731,18 +898,46 @@ void OCCstream::write_file(int fd, const string& fname, off_t from, off_t to)
 	off_t wsize = to - from;
 	write(&wsize, sizeof(wsize));
 	write_hash();
-	while (wsize) {
+	/* Compressibility of big file is checked by beginning of block: every
+	 * block while data is stored, every probe_interval-th while it is
+	 * compressed. So parts of archives and images are compressed or
+	 * stored as they are */
+	bool stored = false;
+	const bool big = wsize > (off_t)sizeof(buf);
+	for (size_t block = 0; wsize; block++) {
 		ssize_t rsize = min((off_t)sizeof(buf), wsize);
 		ssize_t x = readfile(fd, buf, rsize, fname);
 		if (x < rsize)
 			throw exc_error("Unexpected end of file", fname);
+		if (big && (stored || block % probe_interval == 0) && compressible(buf, min(rsize, probe_size)) == stored) {
+			stored = !stored;
+			set_level(stored ? Z_NO_COMPRESSION : Z_DEFAULT_COMPRESSION);
+		}
 		write(buf, rsize);
 		wsize -= rsize;
-		flush_net();
 	}
+	if (stored)
+		set_level(Z_DEFAULT_COMPRESSION);
 	write_hash();
 }
 
+void OCCstream::set_level(int level)
+{
+	Bytef buf[0x1000];
+	zctx.next_in = nullptr;
+	zctx.avail_in = 0;
+	// Data written before is compressed with previous level first
+	int ret;
+	do {
+		zctx.next_out = buf;
+		zctx.avail_out = sizeof(buf);
+		ret = deflateParams(&zctx, level, Z_DEFAULT_STRATEGY);
+		if (ret != Z_OK && ret != Z_BUF_ERROR)
+			error(1, 0, "Zlib deflate error %s", zctx.msg);
+		OCstream::write_nc(buf, zctx.next_out - buf);
+	} while (ret == Z_BUF_ERROR && zctx.next_out != buf);
+}
+
 void OCCstream::write_file(const string& filename)
 {
 	Fstream f = Fstream::open(filename);
@@ -751,6 +946,8 @@ void OCCstream::write_file(const string& filename)
 
 void OCCstream::write_hash()
 {
+	if (cipher == StreamCipher::gcm)
+		return;
 	char buf[SHA1_DIGEST_LENGTH];
 	SHA1Final((uint8_t *)buf, &sctx);
 	SHA1Init(&sctx);
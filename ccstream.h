@@ -4,6 +4,7 @@
 #include <gnutls/crypto.h>
 #include <sha1.h>
 #include <string>
+#include <vector>
 #include "cryptkey.h"
 
 // Complessed Crypted files (or network sockets)
@@ -19,6 +20,15 @@
 
 extern bool dump_crypt;
 
+/* Encryption of ICstream and OCstream
+ * cfb8 - AES-256-CFB8, integrity is checked by SHA-1 hashes written by
+ *        write_hash(). Files and TCP sessions of protocol < 7
+ * gcm  - records up to 64 KiB, each one is authenticated by AES-256-GCM.
+ *        write_hash() and check_hash() do nothing. TCP sessions of protocol 7
+ * Record: size (4 bytes), encrypted data, tag. Size is authenticated too,
+ * record number is part of nonce, so records can't be reordered */
+enum class StreamCipher { cfb8, gcm };
+
 struct Fstream {
 	// Store filename (for error messages)
 	Fstream(const std::string& filename);
@@ -96,7 +106,7 @@ struct Ostream : StreamBase {
 	// Drop cache to file
 	void flush_cache();
 
-	// If file descriptor is network sosket, drop cache and call fsync()
+	// If file descriptor is network sosket, drop cache
 	void flush_net();
 
 	// Get offset of write pointer
@@ -111,7 +121,7 @@ struct Ostream : StreamBase {
 
 // Input Crypted file. Also calculate hash for read data
 struct ICstream {
-	ICstream(Istream&, const CryptKey&);
+	ICstream(Istream&, const CryptKey&, StreamCipher = StreamCipher::cfb8);
 	ICstream(Istream&, const CryptKey&, const Nonce&);
 	ICstream(const ICstream&) = delete;
 	ICstream(ICstream&&) = delete;
@@ -123,18 +133,34 @@ struct ICstream {
 	void read(void *, size_t);
 	void read_nh(void *, size_t); // Read but not calc hash
 
+	/* Read at least one byte and no more than size, wait only if
+	 * nothing is read already. Return size of read data */
+	size_t read_some(void *, size_t size);
+
+	// Return last bytes of read data to stream
+	void unread(size_t);
+
 	/* Read hash object and compare with current state.
 	 * Throw error if hash is wrong */
 	void check_hash();
+
+	const StreamCipher cipher;
 private:
 	void init(const CryptKey&, const Nonce&);
+	void read_record();
 	gnutls_cipher_hd_t cctx = nullptr;
+	gnutls_aead_cipher_hd_t actx = nullptr;
 	SHA1_CTX sctx;
+	Nonce nonce;
+	uint64_t records = 0; // number of read records
+	std::vector<char> record; // decrypted record
+	size_t record_pos = 0;
+	std::vector<char> sealed;
 };
 
 // Output Crypted file. Also calculate hash for written data
 struct OCstream {
-	OCstream(Ostream&, const CryptKey&);
+	OCstream(Ostream&, const CryptKey&, StreamCipher = StreamCipher::cfb8);
 	OCstream(Ostream&, const CryptKey&, const Nonce&);
 	OCstream(const OCstream&) = delete;
 	OCstream(OCstream&&) = delete;
@@ -148,15 +174,25 @@ struct OCstream {
 
 	// Write current state hash
 	void write_hash();
+
+	// Write collected data as record (gcm)
+	void flush();
+
+	const StreamCipher cipher;
 private:
 	void init(const CryptKey&, const Nonce&);
 	gnutls_cipher_hd_t cctx = nullptr;
+	gnutls_aead_cipher_hd_t actx = nullptr;
 	SHA1_CTX sctx;
+	Nonce nonce;
+	uint64_t records = 0; // number of written records
+	std::vector<char> record; // data to be encrypted
+	std::vector<char> sealed;
 };
 
 // Intput Complessed Crypted file (data is compressed and after that is crypted)
 struct ICCstream : ICstream {
-	ICCstream(Istream&, const CryptKey&);
+	ICCstream(Istream&, const CryptKey&, StreamCipher = StreamCipher::cfb8);
 	ICCstream(const ICCstream&) = delete;
 	ICCstream(ICCstream&&) = delete;
 	ICCstream& operator=(const ICCstream&) = delete;
@@ -167,6 +203,7 @@ struct ICCstream : ICstream {
 	void read(void *, size_t);
 	void read_nc(void *, size_t); // Read but not calc hash
 	Json::Value read_json();
+	std::string read_string();
 	void read_to_file(const std::string& filename);
 	void read_to_tempfile(int fd);
 	void skip_file();
@@ -189,7 +226,7 @@ private:
 
 // Output Complessed Crypted file
 struct OCCstream : OCstream {
-	OCCstream(Ostream&, const CryptKey&);
+	OCCstream(Ostream&, const CryptKey&, StreamCipher = StreamCipher::cfb8);
 	OCCstream(const OCCstream&) = delete;
 	OCCstream(OCCstream&&) = delete;
 	OCCstream& operator=(const OCCstream&) = delete;
@@ -200,18 +237,23 @@ struct OCCstream : OCstream {
 	void write(const void *, size_t);
 	void write_nc(const void *, size_t);
 	void write_json(const Json::Value&);
+	void write_string(const std::string&); // size and data, read by ICCstream::read_string()
 	void write_file(int fd, const std::string& filename, off_t from, off_t to);
 	void write_file(const std::string& filename);
 
 	// Write hash of all written data to file descriptor
 	void write_hash();
 
-	// Drop all caches to file and call sync()
+	/* Drop all caches to network socket. Call it only when remote side
+	 * waits for data: every flush costs compression ratio (Z_SYNC_FLUSH)
+	 * and a packet. Does nothing for regular file */
 	void flush_net();
 
 	void close();
 private:
 	void flush_cache();
+	// Change compression level of following data
+	void set_level(int level);
 	char cache[0x1000]; // decrypted compressed data
 	char * ptr;
 	z_stream zctx;
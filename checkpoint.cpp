@@ -0,0 +1,218 @@
+#include "checkpoint.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libintl.h>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include "core.h"
+#include "utils.h"
+#include "exc_error.h"
+#include "warn.h"
+#define _(STRING) gettext(STRING)
+
+using std::string;
+using std::vector;
+using std::move;
+using std::ifstream;
+using std::istringstream;
+using std::exception;
+
+static const char checkpoint_magic[8] = {'D', 'A', 'D', 'M', 'N', 'O', 'D', 'E'};
+static const uint32_t checkpoint_version = 3;
+
+Checkpoint::Checkpoint(const string& fname) : filename(fname)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw exc_errno(_("Error open file"), filename);
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		throw exc_errno(_("Error read file"), filename);
+	}
+	map_size = st.st_size;
+	if (map_size < sizeof(CheckpointHeader)) {
+		close(fd);
+		throw exc_error(_("Node file damaged"), filename);
+	}
+	void * p = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		throw exc_errno(_("Error read file"), filename);
+	map = (const char *)p;
+
+	const CheckpointHeader& h = header();
+	if (memcmp(h.magic, checkpoint_magic, sizeof(checkpoint_magic))
+			|| h.version != checkpoint_version
+			|| h.file_size != map_size) {
+		munmap((void *)map, map_size);
+		throw exc_error(_("Node file damaged"), filename);
+	}
+}
+
+Checkpoint::~Checkpoint()
+{
+	munmap((void *)map, map_size);
+}
+
+bool Checkpoint::detect(const string& filename)
+{
+	char buf[sizeof(checkpoint_magic)];
+	ifstream f(filename);
+	f.read(buf, sizeof(buf));
+	return f && !memcmp(buf, checkpoint_magic, sizeof(buf));
+}
+
+const CheckpointHeader& Checkpoint::header() const
+{
+	return *(const CheckpointHeader *)map;
+}
+
+// Return pointer to part of file, check bounds
+const char * Checkpoint::data(uint64_t off, uint64_t size) const
+{
+	if (off > map_size || size > map_size - off)
+		throw exc_error(_("Node file damaged"), filename);
+	return map + off;
+}
+
+NodeStatus Checkpoint::status() const
+{
+	return (NodeStatus)header().status;
+}
+
+Matrix Checkpoint::nodes() const
+{
+	const CheckpointHeader& h = header();
+	const size_t R = h.nodes;
+	if (R > map_size / sizeof(CheckpointNode))
+		throw exc_error(_("Node file damaged"), filename);
+	const CheckpointNode * recs = (const CheckpointNode *)data(h.matrix_off, R * sizeof(CheckpointNode));
+	const uint64_t * cells = (const uint64_t *)data(h.matrix_off + R * sizeof(CheckpointNode), R * R * sizeof(uint64_t));
+	vector<UUID> ids;
+	ids.reserve(R);
+	for (size_t i = 0; i < R; i++)
+		ids.push_back(recs[i].id);
+	Matrix res;
+	res.init(ids);
+	if (res.size() != R)
+		throw exc_error(_("Node file damaged"), filename);
+	for (size_t i = 0; i < R; i++) {
+		Node& n = res[recs[i].id];
+		memcpy(n.matrix_row.data(), cells + i * R, R * sizeof(uint64_t));
+		n.command_to_exec = recs[i].command_to_exec;
+		n.netmsgcnt = recs[i].netmsgcnt;
+		n.proto_ver = recs[i].proto_ver;
+	}
+	return res;
+}
+
+MsgStore Checkpoint::messages() const
+{
+	const CheckpointHeader& h = header();
+	if (h.msgs > map_size / sizeof(CheckpointMsg))
+		throw exc_error(_("Node file damaged"), filename);
+	const CheckpointMsg * idx = (const CheckpointMsg *)data(h.index_off, h.msgs * sizeof(CheckpointMsg));
+	MsgStore res;
+	for (size_t i = 0; i < h.msgs; i++) {
+		Msg m(idx[i].author, idx[i].number);
+		m.loc.segment = idx[i].segment;
+		m.loc.offset = idx[i].offset;
+		m.loc.size = idx[i].size;
+		m.set_name(string(data(h.names_off + idx[i].name, idx[i].name_size), idx[i].name_size));
+		const CheckpointDep * d = (const CheckpointDep *)data(h.deps_off + idx[i].dep * sizeof(CheckpointDep), idx[i].deps * sizeof(CheckpointDep));
+		for (uint32_t j = 0; j < idx[i].deps; j++)
+			m.depends.emplace_hint(m.depends.end(), d[j].id, d[j].number);
+		m.unload();
+		res.insert(move(m));
+	}
+	return res;
+}
+
+Json::Value Checkpoint::other() const
+{
+	const CheckpointHeader& h = header();
+	Json::Value res;
+	istringstream(string(data(h.json_off, h.json_size), h.json_size)) >> res;
+	return res;
+}
+
+string Checkpoint::encode(CheckpointHeader& h,
+	const Matrix& nodes, const MsgStore& messages, const Json::Value& other)
+{
+	memcpy(h.magic, checkpoint_magic, sizeof(checkpoint_magic));
+	h.version = checkpoint_version;
+	h.reserved = 0;
+
+	const size_t R = nodes.size();
+	vector<CheckpointNode> recs;
+	vector<uint64_t> cells;
+	recs.reserve(R);
+	cells.reserve(R * R);
+	for (const auto& n : nodes) {
+		recs.push_back({n.first, n.second.command_to_exec, n.second.netmsgcnt, (uint64_t)n.second.proto_ver});
+		cells.insert(cells.end(), n.second.matrix_row.begin(), n.second.matrix_row.end());
+	}
+
+	vector<CheckpointMsg> idx;
+	vector<CheckpointDep> deps;
+	string names;
+	idx.reserve(messages.size());
+	for (const Msg& m : messages) {
+		idx.push_back({m.node_id, m.msg_number, m.loc.segment, m.loc.offset, m.loc.size,
+			deps.size(), (uint32_t)m.depends.size(), (uint32_t)m.name.size(), names.size()});
+		for (const auto& d : m.depends)
+			deps.push_back({d.first, d.second});
+		names += m.name;
+	}
+	const string json = compact_string(other);
+
+	h.nodes = R;
+	h.matrix_off = sizeof(CheckpointHeader);
+	h.msgs = idx.size();
+	h.index_off = h.matrix_off + recs.size() * sizeof(CheckpointNode) + cells.size() * sizeof(uint64_t);
+	h.deps_off = h.index_off + idx.size() * sizeof(CheckpointMsg);
+	h.names_off = h.deps_off + deps.size() * sizeof(CheckpointDep);
+	h.json_off = h.names_off + names.size();
+	h.json_size = json.size();
+	h.file_size = h.json_off + h.json_size;
+
+	string res;
+	res.reserve(h.file_size);
+	res.append((const char *)&h, sizeof(h));
+	res.append((const char *)recs.data(), recs.size() * sizeof(CheckpointNode));
+	res.append((const char *)cells.data(), cells.size() * sizeof(uint64_t));
+	res.append((const char *)idx.data(), idx.size() * sizeof(CheckpointMsg));
+	res.append((const char *)deps.data(), deps.size() * sizeof(CheckpointDep));
+	res.append(names);
+	res.append(json);
+	return res;
+}
+
+void Checkpoint::write(const string& filename, const string& data, bool backup)
+{
+	const string tmpname = filename + ".tmp";
+	int fd = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		throw exc_errno(_("Error create file"), tmpname);
+	try {
+		writefile_all(fd, data.data(), data.size(), tmpname);
+		if (fsync(fd))
+			throw exc_errno(_("Error save file"), tmpname);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+	closefile(fd, tmpname);
+	if (backup) {
+		const string bkname = filename + '~';
+		unlink(bkname.c_str());
+		link(filename.c_str(), bkname.c_str());
+	}
+	if (rename(tmpname.c_str(), filename.c_str()))
+		throw exc_errno(_("Error save file"), filename);
+	sync_dir(filename);
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <json/json.h>
+#include "uuid.h"
+
+struct MsgStore;
+struct Matrix;
+enum class NodeStatus : char;
+
+/* Binary checkpoint of node state ('node' file). The file is mapped to
+ * memory on load so nothing but required data is read.
+ * Layout: header, matrix block (node records and R*R cells), message index
+ * sorted by message id, dependencies and names of messages, json block with
+ * other state. Message values are stored in message log (see MsgLog).
+ * Numbers are in host byte order: file is never passed to other nodes. */
+struct CheckpointHeader {
+	char magic[8];
+	uint32_t version;
+	uint8_t status;
+	uint8_t valid_node;
+	uint16_t reserved;
+	uint64_t file_size;
+	uint64_t generation;
+	UUID my_id;
+	UUID invite_id;
+	uint64_t nodes;      // number of nodes (R)
+	uint64_t matrix_off; // R node records then R*R matrix cells
+	uint64_t msgs;       // number of messages
+	uint64_t index_off;  // msgs index records
+	uint64_t deps_off;   // dependencies of all messages
+	uint64_t names_off;  // names of all messages
+	uint64_t json_off;   // json object with other state
+	uint64_t json_size;
+};
+
+struct CheckpointNode {
+	UUID id;
+	uint64_t command_to_exec;
+	uint64_t netmsgcnt;
+	uint64_t proto_ver;
+};
+
+struct CheckpointMsg {
+	UUID author;
+	uint64_t number;
+	uint64_t segment;
+	uint64_t offset;
+	uint64_t size;
+	uint64_t dep;   // first record in dependencies block
+	uint32_t deps;  // number of dependencies
+	uint32_t name_size;
+	uint64_t name;  // offset in names block
+};
+
+struct CheckpointDep {
+	UUID id;
+	uint64_t number;
+};
+
+struct Checkpoint {
+	// Map file to memory. Throw exception if file is not valid checkpoint
+	Checkpoint(const std::string& filename);
+	Checkpoint(const Checkpoint&) = delete;
+	Checkpoint& operator=(const Checkpoint&) = delete;
+	~Checkpoint();
+
+	// Check if file starts with checkpoint signature (may be old json file)
+	static bool detect(const std::string& filename);
+
+	/* Return contents of checkpoint file. Json object 'other' contains
+	 * everything except matrix and messages. All messages must be stored
+	 * in message log */
+	static std::string encode(CheckpointHeader& hdr, const Matrix&,
+		const MsgStore&, const Json::Value& other);
+
+	/* Replace file with new contents: write temporary file, sync it and rename.
+	 * If backup is true, previous file is kept with '~' suffix */
+	static void write(const std::string& filename, const std::string& data, bool backup);
+
+	const CheckpointHeader& header() const;
+	NodeStatus status() const;
+	Matrix nodes() const;
+	// Messages without values, only their place in message log
+	MsgStore messages() const;
+	Json::Value other() const;
+private:
+	const char * data(uint64_t off, uint64_t size) const;
+	std::string filename;
+	const char * map = nullptr;
+	size_t map_size = 0;
+};
@@ -4,44 +4,53 @@
 #include <sys/wait.h>
 #include <libintl.h>
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <filesystem>
 #include "showdebug.h"
 #include "locdatetime.h"
 #include "warn.h"
 #include "utils.h"
 #define _(STRING) gettext(STRING)
 
+namespace fs = std::filesystem;
 using std::map;
 using std::move;
 using std::vector;
 using std::string;
 using std::exception;
+using std::thread;
+using std::atomic;
+using std::min;
+using std::max;
 
 /* This file contains functions executed on commands spread between nodes */
 
 static map<string, void (Core::*)(const Msg&)> cmd_ints = {
 	{"BAD MESSAGE", nullptr},
 	{"addnode", &Core::exec_addnode},
-	{"sethostname", &Core::exec_sethostname},
 	{"delnode", &Core::exec_delnode},
 	{"delnoderecord", &Core::exec_delnoderecord},
 	{"addfile", &Core::exec_addfile},
 	{"delfile", nullptr},
 	{"deldir", nullptr},
-	{"online", &Core::exec_online},
 	{"exec", &Core::exec_exec},
 	{"executed", &Core::exec_executed},
 	{"delexec", &Core::exec_delexec},
 	{"dellog", &Core::exec_dellog},
-	{"antivirus", &Core::exec_antivirus},
 	{"adduser", &Core::exec_adduser},
-	{"deluser", &Core::exec_deluser},
-	{"smart", &Core::exec_smart}
+	{"deluser", &Core::exec_deluser}
 };
 
 void Core::exec(const Msg& cmd)
 {
-	string cmdstr = cmd.value["name"].asString();
+	const string& cmdstr = cmd.name;
 	debug << "Exec " << cmdstr;
+	if (cmd.state_id != StateCmdId::none) {
+		exec_state(cmd);
+		return;
+	}
 	auto p = cmd_ints.find(cmdstr);
 	if (p != cmd_ints.end()) {
 		if (p->second) {
@@ -59,11 +68,11 @@ void Core::exec(const Msg& cmd)
 
 void Core::exec_addnode(const Msg& cmd)
 {
-	Json::Value val = cmd.value["val"];
+	Json::Value val = cmd.value()["val"];
 	UUID id = val;
 	auto n = nodes.find(id);
 	if (n == nodes.end())
-		nodes.resize(id, nullptr, max_proto_ver());
+		new_nodes.push_back(id); // see Core::add_new_nodes()
 	else if (id != my_id)
 		return;
 	else if (!valid_node)
@@ -74,14 +83,9 @@ void Core::exec_addnode(const Msg& cmd)
 	}
 }
 
-void Core::exec_sethostname(const Msg& cmd)
-{
-	state_nodes[string(cmd.node_id)]["hostname"] = cmd.value["val"];
-}
-
 void Core::exec_delnode(const Msg& cmd)
 {
-	UUID id = cmd.value["val"];
+	UUID id = cmd.value()["val"];
 	if (!id || id != my_id)
 		return;
 	status = NodeStatus::deleting;
@@ -89,7 +93,7 @@ void Core::exec_delnode(const Msg& cmd)
 
 void Core::exec_delnoderecord(const Msg& cmd)
 {
-	UUID id = cmd.value["val"];
+	UUID id = cmd.value()["val"];
 	if (!id)
 		return;
 	string name = nodename(id);
@@ -106,22 +110,48 @@ void Core::exec_delnoderecord(const Msg& cmd)
 	rec["type"] = "deadnode";
 	rec["deaduuid"] = str_id;
 	state["log"].append(rec);
+	state_changed = true;
 }
 
-void Core::exec_online(const Msg& cmd)
+void Core::exec_state(const Msg& cmd)
 {
-	state_nodes[string(cmd.node_id)]["online"] = cmd.value["val"];
+	Json::Value& n = state_nodes[string(cmd.node_id)];
+	changed_nodes.insert(cmd.node_id);
+	const StateCmd& s = cmd.state();
+	switch (cmd.state_id) {
+	case StateCmdId::online:
+		n["online"] = std::get<OnlineCmd>(s).date;
+		break;
+	case StateCmdId::antivirus: {
+		const AntivirusCmd& c = std::get<AntivirusCmd>(s);
+		Json::Value rec;
+		rec["updated"] = c.updated;
+		rec["scanned"] = c.scanned;
+		rec["found"] = c.found;
+		n["antivirus"] = move(rec);
+		break;
+	}
+	case StateCmdId::smart:
+		n["smart"] = std::get<SmartCmd>(s).ok;
+		break;
+	case StateCmdId::sethostname:
+		n["hostname"] = std::get<HostnameCmd>(s).hostname;
+		break;
+	default:
+		break;
+	}
 }
 
 void Core::exec_addfile(const Msg& cmd)
 {
-	filenames.insert(cmd.value["filename"].asString());
+	filenames.insert(cmd.value()["filename"].asString());
+	filenames_changed = true;
 }
 
-void Core::exec_exec(const Msg& cmd)
+// Shell command line of 'exec' command
+static string exec_cmdline(const Msg& cmd)
 {
-	vector<string> params;
-	const Json::Value& par = cmd.value["exec"];
+	const Json::Value& par = cmd.value()["exec"];
 	string str;
 	for (Json::Value::ArrayIndex i = 0; i < par.size(); i++)
 		if (par[i].isString()) {
@@ -129,68 +159,176 @@ void Core::exec_exec(const Msg& cmd)
 				str += ' ';
 			str += par[i].asString();
 		}
-	params.push_back("sh");
-	params.push_back("-c");
-	params.push_back(str);
-	string out;
-	if (exec_prog_output(params, out, cfg.filesdir())) {
-		Json::Value newcmd;
-		newcmd["name"] = "executed";
-		newcmd["cmd"] = str;
-		newcmd["date"] = string(loctime(time(nullptr)));
-		newcmd["output"] = out;
-		create_command(move(newcmd));
-	} else
-		warn << _("Error execute command") << ' ' << params[0];
+	return str;
+}
+
+static bool exec_shell(const string& str, Spool& out, const string& dir)
+{
+	vector<string> params = {"sh", "-c", str};
+	try {
+		return exec_prog_output(params, [&out](const char * buf, size_t size) { out.append(buf, size); }, dir);
+	} catch (const exception& e) {
+		warn << e.what();
+		return false;
+	}
+}
+
+void Core::exec_exec(const Msg& cmd)
+{
+	ExecOutput res;
+	res.cmd = exec_cmdline(cmd);
+	res.output = Spool(cfg.exec_spool_size, cfg.filesdir());
+	res.ok = exec_shell(res.cmd, res.output, cfg.filesdir());
+	exec_output(cmd, res);
+}
+
+vector<ExecOutput> Core::exec_parallel(const vector<const Msg *>& cmds) const
+{
+	vector<ExecOutput> res(cmds.size());
+	vector<size_t> idx;
+	for (size_t i = 0; i < cmds.size(); i++)
+		if (cmds[i]->name == "exec")
+			idx.push_back(i);
+	if (idx.size() < 2)
+		return res;
+	for (size_t i : idx) {
+		res[i].run = true;
+		res[i].cmd = exec_cmdline(*cmds[i]);
+		res[i].output = Spool(cfg.exec_spool_size, cfg.filesdir());
+	}
+
+	size_t threads = cfg.exec_threads ? cfg.exec_threads : thread::hardware_concurrency();
+	threads = max<size_t>(1, min(threads, idx.size()));
+	debug << "Run " << idx.size() << " programs in " << threads << " threads";
+	atomic<size_t> next = 0;
+	auto worker = [&]() {
+		for (size_t i; (i = next++) < idx.size();) {
+			ExecOutput& r = res[idx[i]];
+			r.ok = exec_shell(r.cmd, r.output, cfg.filesdir());
+		}
+	};
+	vector<thread> pool;
+	for (size_t i = 1; i < threads; i++)
+		pool.emplace_back(worker);
+	worker();
+	for (thread& t : pool)
+		t.join();
+	return res;
+}
+
+bool Core::exec_start(const MsgId&, const string&)
+{
+	return false;
+}
+
+bool Core::exec_background(const Msg& cmd)
+{
+	if (cmd.name != "exec" || !exec_start(cmd, exec_cmdline(cmd)))
+		return false;
+	exec_running.insert(cmd);
+	return true;
+}
+
+void Core::exec_done(const MsgId& id, const ExecOutput& res)
+{
+	exec_running.erase(id);
+	if (res.cancelled)
+		return; // will be started again
+	const Msg * cmd = find_command(id);
+	if (!cmd)
+		return;
+	debug << "Exec finished: " << res.cmd;
+	exec_output(id, res);
+	mark_as_executed(*cmd);
+	need_save = true;
+}
+
+void Core::exec_output(const MsgId& id, const ExecOutput& res)
+{
+	if (!res.ok) {
+		warn << _("Error execute command") << ' ' << "sh";
+		return;
+	}
+	Json::Value newcmd;
+	newcmd["name"] = "executed";
+	newcmd["cmd"] = res.cmd;
+	newcmd["date"] = string(loctime(time(nullptr)));
+	newcmd["output"] = res.output.head(cfg.exec_preview_size);
+	const size_t size = res.output.size();
+	if (size > cfg.exec_preview_size) {
+		// Command keeps only beginning of output, whole output is spread as file
+		const string fn = string(exec_output_dir) + '/' + string(my_id) + '-'
+			+ string(id.node_id) + '-' + std::to_string(id.msg_number);
+		fs::create_directories(cfg.filesdir() + '/' + exec_output_dir);
+		res.output.save(cfg.filesdir() + '/' + fn);
+		add_file(fn);
+		newcmd["output-file"] = fn;
+		newcmd["output-size"] = size;
+	}
+	create_command(move(newcmd));
 }
 
 void Core::exec_executed(const Msg& cmd)
 {
 	Json::Value rec;
-	rec["cmd"] = cmd.value["cmd"];
+	rec["cmd"] = cmd.value()["cmd"];
 	rec["uuid"] = string(cmd.node_id);
-	rec["date"] = cmd.value["date"];
-	rec["output"] = cmd.value["output"];
+	rec["date"] = cmd.value()["date"];
+	rec["output"] = cmd.value()["output"];
+	if (cmd.value().isMember("output-file")) {
+		rec["output-file"] = cmd.value()["output-file"];
+		rec["output-size"] = cmd.value()["output-size"];
+	}
 	state["exec"].append(rec);
 }
 
 void Core::exec_delexec(const Msg& cmd)
 {
-	string filter = cmd.value["filter"].asString();
+	string filter = cmd.value()["filter"].asString();
 	Json::Value& elist = state["exec"];
+	state_changed = true;
+	// Files with output are deleted by node which created them
+	const string my_prefix = string(exec_output_dir) + '/' + string(my_id) + '-';
+	auto del_output = [&](const Json::Value& rec) {
+		const Json::Value& fn = rec["output-file"];
+		if (!fn.isString() || !fn.asString().starts_with(my_prefix))
+			return;
+		Json::Value delcmd;
+		delcmd["name"] = "delfile";
+		delcmd["filename"] = fn;
+		create_command(move(delcmd));
+	};
 	if (filter.empty()) {
+		for (const Json::Value& rec : elist)
+			del_output(rec);
 		elist = Json::arrayValue;
 		return;
 	}
 
 	Json::Value removed;
 	for (Json::Value::ArrayIndex i = 0; i < elist.size(); i++)
-		if (elist[i]["cmd"] == filter)
+		if (elist[i]["cmd"] == filter) {
 			elist.removeIndex(i--, &removed);
+			del_output(removed);
+		}
 }
 
 void Core::exec_dellog(const Msg& cmd)
 {
 	state["log"].clear();
-}
-
-void Core::exec_antivirus(const Msg& cmd)
-{
-	Json::Value rec;
-	rec["updated"] = cmd.value["updated"];
-	rec["scanned"] = cmd.value["scanned"];
-	rec["found"] = cmd.value["found"];
-	state_nodes[string(cmd.node_id)]["antivirus"] = move(rec);
+	state_changed = true;
 }
 
 void Core::exec_adduser(const Msg& cmd)
 {
-	string line = cmd.value["val"].asString();
+	string line = cmd.value()["val"].asString();
 	users.add(line);
+	users_changed = true;
 }
 
 void Core::exec_deluser(const Msg& cmd)
 {
-	string nick = cmd.value["val"].asString();
+	string nick = cmd.value()["val"].asString();
 	users.del(nick);
+	users_changed = true;
 }
@@ -37,6 +37,42 @@ static vector<string> default_iface_names()
 	return res;
 }
 
+// Parse size with optional suffix K, M, G, T or P. Return -1 if suffix is bad
+static size_t parse_size(string_view str)
+{
+	size_t x = 0;
+	char ch = '\0';
+	string s(str);
+	istringstream(s) >> x >> ch;
+	switch (ch) {
+	case '\0':
+		break;
+	case 'K':
+	case 'k':
+		x *= 0x400UL;
+		break;
+	case 'M':
+	case 'm':
+		x *= 0x400UL * 0x400;
+		break;
+	case 'G':
+	case 'g':
+		x *= 0x400UL * 0x400 * 0x400;
+		break;
+	case 'T':
+	case 't':
+		x *= 0x400UL * 0x400 * 0x400 * 0x400;
+		break;
+	case 'P':
+	case 'p':
+		x *= 0x400UL * 0x400 * 0x400 * 0x400 * 0x400;
+		break;
+	default:
+		return -1UL;
+	}
+	return x;
+}
+
 // ========== Config ===========
 
 void Config::load()
@@ -67,37 +103,70 @@ bool Config::process_line(string_view s1, string_view s2)
 		istringstream(s) >> x;
 		if (x) port = x;
 		return true;
-	} else if (s1 == "files-granularity") {
-		size_t x = 0;
-		char ch = '\0';
+	} else if (s1 == "save-delay") {
+		unsigned x = 0;
 		string s(s2);
-		istringstream(s) >> x >> ch;
-		switch (ch) {
-		case '\0':
-			break;
-		case 'K':
-		case 'k':
-			x *= 0x400UL;
-			break;
-		case 'M':
-		case 'm':
-			x *= 0x400UL * 0x400;
-			break;
-		case 'G':
-		case 'g':
-			x *= 0x400UL * 0x400 * 0x400;
-			break;
-		case 'T':
-		case 't':
-			x *= 0x400UL * 0x400 * 0x400 * 0x400;
-			break;
-		case 'P':
-		case 'p':
-			x *= 0x400UL * 0x400 * 0x400 * 0x400 * 0x400;
-			break;
-		default:
+		istringstream(s) >> x;
+		save_delay = x;
+		return true;
+	} else if (s1 == "exec-threads") {
+		unsigned x = 0;
+		string s(s2);
+		istringstream(s) >> x;
+		exec_threads = x;
+		return true;
+	} else if (s1 == "client-sessions") {
+		unsigned x = 0;
+		string s(s2);
+		istringstream(s) >> x;
+		if (x) client_sessions = x;
+		return true;
+	} else if (s1 == "server-sessions") {
+		unsigned x = 0;
+		string s(s2);
+		istringstream(s) >> x;
+		if (x) server_sessions = x;
+		return true;
+	} else if (s1 == "exec-timeout") {
+		unsigned x = 0;
+		string s(s2);
+		istringstream(s) >> x;
+		exec_timeout = x;
+		return true;
+	} else if (s1 == "exec-cpu-limit") {
+		unsigned x = 0;
+		string s(s2);
+		istringstream(s) >> x;
+		exec_cpu_limit = x;
+		return true;
+	} else if (s1 == "exec-output-limit") {
+		size_t x = parse_size(s2);
+		if (x == -1UL)
+			return false;
+		exec_output_limit = x;
+		return true;
+	} else if (s1 == "exec-memory-limit") {
+		size_t x = parse_size(s2);
+		if (x == -1UL)
+			return false;
+		exec_memory_limit = x;
+		return true;
+	} else if (s1 == "exec-spool-size") {
+		size_t x = parse_size(s2);
+		if (x == -1UL)
+			return false;
+		exec_spool_size = x;
+		return true;
+	} else if (s1 == "exec-preview-size") {
+		size_t x = parse_size(s2);
+		if (x == -1UL)
+			return false;
+		exec_preview_size = x;
+		return true;
+	} else if (s1 == "files-granularity") {
+		size_t x = parse_size(s2);
+		if (x == -1UL)
 			return false;
-		}
 		if (x) files_granularity = x;
 		return true;
 	} else if (s1 == "listen") {
@@ -57,6 +57,34 @@ struct Config {
 	/* File containing info about found viruses or emptyfile otherwise */
 	std::string av_results_file;
 
+	/* Delay in milliseconds to collect changes before saving them to disk
+	 * in daemon mode */
+	unsigned save_delay = 500;
+
+	/* Max number of programs run at once by 'exec' commands,
+	 * 0 - number of processors */
+	unsigned exec_threads = 0;
+
+	/* Max number of TCP sessions with other nodes run at once: initiated
+	 * by this node (client) and accepted from other nodes (server) */
+	unsigned client_sessions = 4;
+	unsigned server_sessions = 4;
+
+	/* Limits for programs of 'exec' commands run by daemon, 0 - no limit.
+	 * Program is killed after exec_timeout seconds, output after
+	 * exec_output_limit bytes is dropped. CPU time (seconds) and memory
+	 * (bytes) are limited by setrlimit() */
+	unsigned exec_timeout = 0;
+	size_t exec_output_limit = 0x1000000;
+	unsigned exec_cpu_limit = 0;
+	size_t exec_memory_limit = 0;
+
+	/* Output of 'exec' program larger than exec_spool_size is kept in
+	 * temporary file instead of memory. Only exec_preview_size bytes of
+	 * output are kept in command, whole output is spread as file */
+	size_t exec_spool_size = 0x100000;
+	size_t exec_preview_size = 0x1000;
+
 	/* Packet file used to import-export data (exchange between nodes) */
 	std::string packet_file;
 
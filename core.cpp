@@ -18,6 +18,11 @@
 #include "utils_iface.h"
 #include "utils.h"
 #include "tmpdir.h"
+#include "checkpoint.h"
+#include "execqueue.h"
+#include "rowops.h"
+#include "matrixdelta.h"
+#include "varint.h"
 #include "exc_error.h"
 #include "locdatetime.h"
 #include "warn.h"
@@ -37,8 +42,12 @@ using std::find;
 using std::flush;
 using std::map;
 using std::sort;
+using std::unique;
+using std::any_of;
 using std::move;
 using std::vector;
+using std::pair;
+using std::function;
 using std::string;
 using std::string_view;
 using std::ifstream;
@@ -48,14 +57,23 @@ using std::unique_ptr;
 using std::istringstream;
 using std::ostringstream;
 using std::mutex;
-using std::uniform_int_distribution;
 using std::chrono::system_clock;
 typedef std::lock_guard<mutex> lock;
 
 Core * core;
 
-/* Used in read/write_packet(), read/write _ online/offline _ invite(),*/
-const short protocol_version = 1;
+/* Version of network protocol and packets. Nodes use the highest version
+ * supported by all nodes of group, see Core::max_proto_ver().
+ * 2 - only changes of matrix are sent in TCP sessions
+ * 3 - matrix in packets and invites is written by Matrix::write_compact()
+ * 4 - node hash is calculated by Matrix::hash()
+ * 5 - UDP helo has root of Merkle tree over row of node, see RowTree
+ * 6 - commands are requested by ranges in TCP sessions
+ * 7 - TCP sessions are encrypted by AES-256-GCM records, see StreamCipher */
+const short protocol_version = 7;
+
+// Version of group id in file 'group-id' and invites
+static const short group_id_version = 1;
 
 const map<string, NodeStatus> distadm_statuses = {
 	{"uninitialized", NodeStatus::uninitialized},
@@ -134,13 +152,6 @@ bool join_group(Config& cfg, const string& filename)
 
 Node::Node(const Json::Value& json)
 {
-	const Json::Value& jrow = json["row"];
-	if (jrow.isArray()) {
-		Json::ArrayIndex n = jrow.size();
-		matrix_row.resize(n);
-		for (Json::ArrayIndex i = 0; i < n; i++)
-			matrix_row[i] = jrow[i].asUInt64();
-	}
 	if (json["cmd"].isUInt64())
 		command_to_exec = json["cmd"].asUInt64();
 	if (json["netmsgcnt"].isUInt64())
@@ -149,12 +160,14 @@ Node::Node(const Json::Value& json)
 		proto_ver = json["proto-ver"].asUInt64();
 }
 
-void Node::update(Json::Value& val) const
+void Node::update(Json::Value& val, bool with_row) const
 {
-	Json::Value jrow = Json::arrayValue;
-	for(size_t x : matrix_row)
-		jrow.append(x);
-	val["row"] = move(jrow);
+	if (with_row) {
+		Json::Value jrow = Json::arrayValue;
+		for(size_t x : matrix_row)
+			jrow.append(x);
+		val["row"] = move(jrow);
+	}
 	val["cmd"] = command_to_exec;
 	val["netmsgcnt"] = netmsgcnt;
 	val["proto-ver"] = proto_ver;
@@ -187,14 +200,18 @@ Msg::Msg(const UUID& id, size_t num) : MsgId(id, num)
 {
 }
 
-Msg::Msg(const Json::Value& src) : MsgId(src), value(src["value"])
+const MsgLog * Msg::storage = nullptr;
+
+Msg::Msg(const Json::Value& src) : MsgId(src), val(src["value"])
 {
 	if (!valid()) {
-		value["old-name"] = value["name"];
-		value["name"] = "BAD MESSAGE";
+		val["old-name"] = val["name"];
+		val["name"] = "BAD MESSAGE";
+		set_name("BAD MESSAGE");
 		warn << _("Bad command found") << ' ' << src["value"];
 		return;
 	}
+	set_name(val["name"].asString());
 	const Json::Value& d = src["depends"];
 	for (auto i = d.begin(); i != d.end(); i++) {
 		UUID id = i.key();
@@ -211,42 +228,119 @@ Json::Value Msg::as_json() const
 	Json::Value res;
 	res["author_id"] = string(node_id);
 	res["number"] = msg_number;
- 	res["value"] = value;
+ 	res["value"] = value();
  	Json::Value& d = res["depends"];
  	for(const auto& i : depends)
 		d[string(i.first)] = i.second;
 	return res;
 }
 
+const string& Msg::body() const
+{
+	if (!body_str.empty())
+		return body_str;
+	if (!loaded) {
+		body_str = storage->read(node_id, loc);
+		return body_str;
+	}
+	Json::Value res;
+	res["value"] = value();
+	Json::Value& d = res["depends"];
+	for(const auto& i : depends)
+		d[string(i.first)] = i.second;
+	body_str = compact_string(res);
+	return body_str;
+}
+
+string Msg::encoded() const
+{
+	// Order of keys doesn't matter for readers
+	const string& b = body();
+	string res = "{\"author_id\":\"" + string(node_id) + "\",\"number\":" + std::to_string(msg_number) + ',';
+	res.append(b, 1);
+	return res;
+}
+
+const Json::Value& Msg::value() const
+{
+	if (!loaded) {
+		Json::Value b;
+		istringstream(body()) >> b;
+		val = move(b["value"]);
+		loaded = true;
+	}
+	return val;
+}
+
+void Msg::set_value(Json::Value&& v)
+{
+	val = move(v);
+	set_name(static_cast<const Json::Value&>(val)["name"].asString());
+	loaded = true;
+	body_str.clear();
+}
+
+void Msg::set_state(StateCmd&& cmd)
+{
+	set_value(state_cmd_json(cmd));
+	state_rec = std::make_shared<const StateCmd>(move(cmd));
+}
+
+const StateCmd& Msg::state() const
+{
+	if (!state_rec)
+		state_rec = std::make_shared<const StateCmd>(state_cmd(value()));
+	return *state_rec;
+}
+
+void Msg::set_name(string&& n)
+{
+	name = move(n);
+	state_id = state_cmd_id(name);
+	state_rec.reset();
+}
+
+void Msg::unload() const
+{
+	if (!loc.stored())
+		return;
+	val = Json::Value();
+	loaded = false;
+	body_str.clear();
+	body_str.shrink_to_fit();
+}
+
 size_t Msg::total_size() const
 {
-	size_t size = compact_string(as_json()).size();
-	if (value["name"] != "addfile")
+	size_t size = encoded().size();
+	if (name != "addfile")
 		return size;
-	const Json::Value& jfrom = value["from"];
-	const Json::Value& jto = value["to"];
+	const Json::Value& v = value();
+	const Json::Value& jfrom = v["from"];
+	const Json::Value& jto = v["to"];
 	if (jfrom.isInt64() && jto.isInt64()) {
 		size_t from = jfrom.asInt64();
 		size_t to = jto.asInt64();
 		size += to - from;
 		return size;
 	}
-	const Json::Value& fn = value["filename"];
+	const Json::Value& fn = v["filename"];
 	if (fn.isString())
-		size += fs::file_size(value["filename"].asString());
+		size += fs::file_size(v["filename"].asString());
 	return size;
 }
 
 bool Msg::valid() const
 {
-	if (!value["name"].isString())
+	const Json::Value& v = value();
+	if (!v["name"].isString())
 		return false;
-	if (value["name"] == "addfile") {
-		if (!value["filename"].isString())
+	if (v["name"] == "addfile") {
+		if (!v["filename"].isString())
 			return false;
-		const Json::Value& jfrom = value["from"];
-		const Json::Value& jto = value["to"];
-		if (value["from"].isInt64() && value["to"].isInt64()) {
+		const Json::Value& jfrom = v["from"];
+		const Json::Value& jto = v["to"];
+		if (v["from"].isInt64() && v["to"].isInt64()) {
 			size_t from = jfrom.asInt64();
 			size_t to = jto.asInt64();
 			if (from > to)
@@ -256,8 +350,361 @@ bool Msg::valid() const
 	return true;
 }
 
+// ===== MsgStore =====
+
+MsgStore::MsgStore(const MsgStore& that) :
+	index(that.index),
+	count(that.count),
+	force_del(that.force_del)
+{
+	order.reserve(that.order.size());
+	for (const AuthorMsgs * a : that.order)
+		order.push_back(&index.at(a->id));
+}
+
+MsgStore& MsgStore::operator=(const MsgStore& that)
+{
+	if (this != &that) {
+		MsgStore x(that);
+		*this = move(x);
+	}
+	return *this;
+}
+
+MsgStore::const_iterator::const_iterator(Authors::const_iterator p, Authors::const_iterator e) :
+	a(p),
+	a_end(e)
+{
+	skip_empty();
+}
+
+void MsgStore::const_iterator::skip_empty()
+{
+	while (a != a_end && (i == (*a)->msgs.size() || !(*a)->msgs[i])) {
+		if (i == (*a)->msgs.size()) {
+			++a;
+			i = 0;
+		} else
+			i++;
+	}
+}
+
+const Msg& MsgStore::const_iterator::operator*() const
+{
+	return *(*a)->msgs[i];
+}
+
+const Msg * MsgStore::const_iterator::operator->() const
+{
+	return &*(*a)->msgs[i];
+}
+
+MsgStore::const_iterator& MsgStore::const_iterator::operator++()
+{
+	i++;
+	skip_empty();
+	return *this;
+}
+
+bool MsgStore::const_iterator::operator==(const const_iterator& that) const
+{
+	return a == that.a && (a == a_end || i == that.i);
+}
+
+MsgStore::const_iterator MsgStore::begin() const
+{
+	return const_iterator(order.begin(), order.end());
+}
+
+MsgStore::const_iterator MsgStore::end() const
+{
+	return const_iterator(order.end(), order.end());
+}
+
+size_t MsgStore::size() const
+{
+	return count;
+}
+
+bool MsgStore::empty() const
+{
+	return !count;
+}
+
+void MsgStore::clear()
+{
+	index.clear();
+	order.clear();
+	force_del.clear();
+	count = 0;
+}
+
+const Msg * MsgStore::find(const MsgId& id) const
+{
+	auto a = index.find(id.node_id);
+	if (a == index.end())
+		return nullptr;
+	const AuthorMsgs& am = a->second;
+	if (id.msg_number < am.base || id.msg_number - am.base >= am.msgs.size())
+		return nullptr;
+	const std::optional<Msg>& m = am.msgs[id.msg_number - am.base];
+	return m ? &*m : nullptr;
+}
+
+size_t MsgStore::first(const UUID& author) const
+{
+	auto a = index.find(author);
+	return a == index.end() ? 0 : a->second.base;
+}
+
+bool MsgStore::contains(const MsgId& id) const
+{
+	return find(id);
+}
+
+MsgStore::AuthorMsgs& MsgStore::author(const UUID& id)
+{
+	auto p = index.try_emplace(id);
+	AuthorMsgs& a = p.first->second;
+	if (p.second) {
+		a.id = id;
+		auto x = std::lower_bound(order.begin(), order.end(), id,
+			[](const AuthorMsgs * a, const UUID& id) { return a->id < id; });
+		order.insert(x, &a);
+	}
+	return a;
+}
+
+void MsgStore::remove_author(const UUID& id)
+{
+	auto x = std::lower_bound(order.begin(), order.end(), id,
+		[](const AuthorMsgs * a, const UUID& id) { return a->id < id; });
+	if (x != order.end() && (*x)->id == id)
+		order.erase(x);
+	index.erase(id);
+}
+
+void MsgStore::trim(AuthorMsgs& a)
+{
+	while (!a.msgs.empty() && !a.msgs.front()) {
+		a.msgs.pop_front();
+		a.base++;
+	}
+	while (!a.msgs.empty() && !a.msgs.back())
+		a.msgs.pop_back();
+	if (a.msgs.empty())
+		remove_author(a.id);
+}
+
+pair<const Msg *, bool> MsgStore::insert(Msg&& msg)
+{
+	AuthorMsgs& a = author(msg.node_id);
+	const size_t n = msg.msg_number;
+	if (a.msgs.empty())
+		a.base = n;
+	// Elements of deque don't move when it grows at the ends
+	for (; n < a.base; a.base--)
+		a.msgs.emplace_front();
+	if (n - a.base >= a.msgs.size())
+		a.msgs.resize(n - a.base + 1);
+	std::optional<Msg>& m = a.msgs[n - a.base];
+	if (m)
+		return {&*m, false};
+	m.emplace(move(msg));
+	count++;
+	count_force(*m, 1);
+	return {&*m, true};
+}
+
+void MsgStore::erase(const MsgId& id)
+{
+	auto p = index.find(id.node_id);
+	if (p == index.end())
+		return;
+	AuthorMsgs& a = p->second;
+	if (id.msg_number < a.base || id.msg_number - a.base >= a.msgs.size())
+		return;
+	std::optional<Msg>& m = a.msgs[id.msg_number - a.base];
+	if (!m)
+		return;
+	count_force(*m, -1);
+	m.reset();
+	count--;
+	trim(a);
+}
+
+void MsgStore::truncate(const UUID& author, size_t number, const function<void(const Msg&)>& f)
+{
+	for (;;) {
+		auto p = index.find(author);
+		if (p == index.end())
+			return;
+		AuthorMsgs& a = p->second;
+		if (a.base >= number)
+			return;
+		f(*a.msgs.front()); // may insert commands
+		count_force(*a.msgs.front(), -1);
+		a.msgs.front().reset();
+		count--;
+		trim(a);
+	}
+}
+
+vector<UUID> MsgStore::authors() const
+{
+	vector<UUID> res;
+	res.reserve(order.size());
+	for (const AuthorMsgs * a : order)
+		res.push_back(a->id);
+	return res;
+}
+
+bool MsgStore::force_deleted(const UUID& id) const
+{
+	return force_del.contains(id);
+}
+
+void MsgStore::count_force(const Msg& m, int x)
+{
+	if (m.name != "delnode")
+		return;
+	const Json::Value& v = m.value();
+	if (v["force"] == true) {
+		UUID id = v["val"];
+		if ((force_del[id] += x) == 0)
+			force_del.erase(id);
+	}
+	m.unload();
+}
+
 // ===== Matrix =====
 
+bool MatrixRow::operator==(const MatrixRow& that) const
+{
+	return n == that.n && row_equal(p, that.p, n);
+}
+
+Matrix::Matrix(const Matrix& that) :
+	map<UUID, Node>(that),
+	cells(that.cells)
+{
+	rebind();
+}
+
+Matrix::Matrix(Matrix&& that) :
+	map<UUID, Node>(move(that)),
+	cells(move(that.cells))
+{
+	rebind();
+	that.clear();
+}
+
+Matrix& Matrix::operator=(const Matrix& that)
+{
+	if (this != &that) {
+		map<UUID, Node>::operator=(that);
+		cells = that.cells;
+		rebind();
+	}
+	return *this;
+}
+
+Matrix& Matrix::operator=(Matrix&& that)
+{
+	if (this != &that) {
+		map<UUID, Node>::operator=(move(that));
+		cells = move(that.cells);
+		rebind();
+		that.clear();
+	}
+	return *this;
+}
+
+void Matrix::rebind()
+{
+	const size_t N = size();
+	index.clear();
+	index.reserve(N);
+	ids.clear();
+	ids.reserve(N);
+	size_t i = 0;
+	for (auto& n : *this) {
+		n.second.matrix_row.p = cells.data() + i * N;
+		n.second.matrix_row.n = N;
+		index.emplace(n.first, i++);
+		ids.push_back(&n.first);
+	}
+	touched.clear();
+	is_touched.assign(N, false);
+	hash_valid = false;
+	layout_cnt++;
+	changed.assign(N, false);
+}
+
+vector<char> Matrix::take_changed()
+{
+	vector<char> res(size(), false);
+	res.swap(changed);
+	return res;
+}
+
+void Matrix::touch(const UUID& id)
+{
+	ssize_t x = node_offset(id);
+	if (x != -1)
+		touch(x);
+}
+
+void Matrix::touch(size_t offset)
+{
+	changed[offset] = true;
+	if (!is_touched[offset]) {
+		is_touched[offset] = true;
+		touched.push_back(offset);
+	}
+}
+
+SHA256 Matrix::hash() const
+{
+	const size_t N = size();
+	auto row_hash = [this, N](size_t i) {
+		SHA256_CTX ctx;
+		SHA256_Init(&ctx);
+		SHA256_Update(&ctx, (const uint8_t *)ids[i], sizeof(UUID));
+		SHA256_Update(&ctx, (const uint8_t *)&cells[i * N], N * sizeof(size_t));
+		RowHash res;
+		SHA256_Final((uint8_t *)res.data(), &ctx);
+		return res;
+	};
+
+	if (!hash_valid) {
+		row_hashes.resize(N);
+		hash_sum.fill(0);
+		for (size_t i = 0; i < N; i++) {
+			row_hashes[i] = row_hash(i);
+			for (size_t k = 0; k < hash_sum.size(); k++)
+				hash_sum[k] += row_hashes[i][k];
+		}
+		hash_valid = true;
+	} else
+		for (size_t i : touched) {
+			RowHash h = row_hash(i);
+			for (size_t k = 0; k < hash_sum.size(); k++)
+				hash_sum[k] += h[k] - row_hashes[i][k];
+			row_hashes[i] = h;
+		}
+	for (size_t i : touched)
+		is_touched[i] = false;
+	touched.clear();
+
+	SHA256 res;
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, (const uint8_t *)hash_sum.data(), sizeof(hash_sum));
+	SHA256_Final(res.hash, &ctx);
+	return res;
+}
+
 Node& Matrix::operator[](const UUID& id)
 {
 	auto p = find(id);
@@ -268,7 +715,23 @@ Node& Matrix::operator[](const UUID& id)
 
 void Matrix::create(const UUID& id)
 {
-	(map<UUID, Node>::operator[])(id);
+	init({id});
+}
+
+void Matrix::init(const vector<UUID>& ids)
+{
+	clear();
+	for (const UUID& id : ids)
+		emplace(id, Node());
+	cells.assign(size() * size(), 0);
+	rebind();
+}
+
+void Matrix::clear()
+{
+	map<UUID, Node>::clear();
+	cells.clear();
+	rebind();
 }
 
 Matrix Matrix::read(ICCstream& f)
@@ -287,10 +750,11 @@ Matrix Matrix::read(ICCstream& f)
 	f.read(proto_ver.data(), R * sizeof(short));
 	f.check_hash();
 	Matrix res;
+	res.init(uuids);
+	if (res.size() != R)
+		throw exc_error(_("Bad UUID"));
 	for (size_t i = 0; i < R; i++) {
-		const UUID& id = uuids[i];
-		Node& n = (*(map<UUID, Node>*)&res)[id];
-		n.matrix_row.resize(R);
+		Node& n = res[uuids[i]];
 		copy(&mtx[i * R], &mtx[i * R + R], n.matrix_row.data());
 		n.netmsgcnt = netmsgcnt[i];
 		n.proto_ver = proto_ver[i];
@@ -311,6 +775,60 @@ Matrix Matrix::read_vld(ICCstream& f)
 	return res;
 }
 
+Matrix Matrix::read_compact(ICCstream& f, bool vld)
+{
+	const string data = f.read_string();
+	const char * p = data.data();
+	const char * end = p + data.size();
+	size_t R = get_varint(p, end);
+	if (R > size_t(end - p) / sizeof(UUID))
+		throw exc_error(_("Bad matrix"));
+	vector<UUID> uuids(R);
+	memcpy(uuids.data(), p, R * sizeof(UUID));
+	p += R * sizeof(UUID);
+	Matrix res;
+	res.init(uuids);
+	if (res.size() != R)
+		throw exc_error(_("Bad UUID"));
+	const size_t * prev = nullptr;
+	for (const UUID& id : uuids) {
+		Node& n = res[id];
+		n.netmsgcnt = get_varint(p, end);
+		n.proto_ver = get_varint(p, end);
+		if (vld)
+			n.command_to_exec = get_varint(p, end);
+		size_t * row = n.matrix_row.data();
+		for (size_t j = 0; j < R; j++)
+			row[j] = (prev ? prev[j] : 0) + get_svarint(p, end);
+		prev = row;
+	}
+	if (p != end)
+		throw exc_error(_("Bad matrix"));
+	return res;
+}
+
+void Matrix::write_compact(OCCstream& f, bool vld) const
+{
+	const size_t R = size();
+	string data;
+	put_varint(data, R);
+	for (const auto& n : *this)
+		data.append((const char *)&n.first, sizeof(UUID));
+	// Rows are almost equal, so differences are small numbers
+	const size_t * prev = nullptr;
+	for (const auto& n : *this) {
+		put_varint(data, n.second.netmsgcnt);
+		put_varint(data, n.second.proto_ver);
+		if (vld)
+			put_varint(data, n.second.command_to_exec);
+		const size_t * row = n.second.matrix_row.data();
+		for (size_t j = 0; j < R; j++)
+			put_svarint(data, row[j] - (prev ? prev[j] : 0));
+		prev = row;
+	}
+	f.write_string(data);
+}
+
 void Matrix::write(OCCstream& f) const
 {
 	size_t R = size();
@@ -323,22 +841,18 @@ void Matrix::write(OCCstream& f, size_t R) const
 	f.write_hash();
 
 	vector<UUID> uuids;
-	vector<size_t> mtx;
 	vector<size_t> netmsgcnt;
 	vector<short> proto_ver;
 	uuids.reserve(R);
-	mtx.reserve(R * R);
 	netmsgcnt.reserve(R);
 	proto_ver.reserve(R);
 	for (const auto& n : *this) {
 		uuids.push_back(n.first);
-		for (size_t x : n.second.matrix_row)
-			mtx.push_back(x);
 		netmsgcnt.push_back(n.second.netmsgcnt);
 		proto_ver.push_back(n.second.proto_ver);
 	}
 	f.write(uuids.data(), R * sizeof(UUID));
-	f.write(mtx.data(), R * R * sizeof(size_t));
+	f.write(cells.data(), R * R * sizeof(size_t));
 	f.write(netmsgcnt.data(), R * sizeof(size_t));
 	f.write(proto_ver.data(), R * sizeof(short));
 	f.write_hash();
@@ -360,56 +874,82 @@ bool Matrix::update(const Matrix& src)
 {
 	bool updated = false;
 	size_t M = size();
-	vector<UUID> my_ids;
-	my_ids.reserve(M);
-	for (const auto& n : *this)
-		my_ids.push_back(n.first);
 
-	size_t R = src.size();
-	vector<UUID> remote_ids;
-	remote_ids.reserve(R);
-	for (const auto& n : src)
-		remote_ids.push_back(n.first);
+	// Usually both matrices have the same nodes, then rows are merged as is
+	bool same = M == src.size();
+	for (auto m = cbegin(), r = src.begin(); same && m != end(); m++, r++)
+		same = m->first == r->first;
+	if (same) {
+		auto r = src.begin();
+		size_t i = 0;
+		for (auto& n : *this) {
+			if (row_max(n.second.matrix_row.data(), r->second.matrix_row.data(), M)) {
+				touch(i);
+				updated = true;
+			}
+			i++;
+			updated |= n.second.netmsgcnt < r->second.netmsgcnt;
+			n.second.netmsgcnt = max(n.second.netmsgcnt, r->second.netmsgcnt);
+			n.second.proto_ver = max(n.second.proto_ver, r->second.proto_ver);
+			r++;
+		}
+		return updated;
+	}
 
-	// Preparation to update : cell indexed 'i' in my row has source 'r_idx[i]' or -1
+	// Cell indexed 'i' in my row has source 'r_idx[i]' or -1
 	vector<size_t> r_idx; // indexes in remote row
 	r_idx.reserve(M);
-
-	size_t m = 0;
-	size_t r = 0;
-	while (m < M && r < R) {
-		while (r < R && remote_ids[r] < my_ids[m])
-			r++;
-		if (r < R && remote_ids[r] == my_ids[m])
-			r_idx.push_back(r++);
-		else
-			r_idx.push_back(-1UL);
-		m++;
+	for (const auto& n : *this) {
+		auto r = src.index.find(n.first);
+		r_idx.push_back(r == src.index.end() ? -1UL : r->second);
 	}
-	while (r_idx.size() < M) r_idx.push_back(-1UL);
 
-	m = 0;
-	r = 0;
-	auto rptr = src.begin();
+	size_t m = 0;
 	for (auto& n : *this) {
 		if (r_idx[m] != -1UL) {
-			while (r < r_idx[m]) rptr++, r++;
 			size_t * my_row = n.second.matrix_row.data();
-			const size_t * remote_row = rptr->second.matrix_row.data();
+			const Node& rn = src.find(n.first)->second;
+			const size_t * remote_row = rn.matrix_row.data();
 			for (size_t i = 0; i < M; i++)
-				if (r_idx[i] != -1UL) {
-					updated |= my_row[i] < remote_row[r_idx[i]];
-					my_row[i] = max(my_row[i], remote_row[r_idx[i]]);
+				if (r_idx[i] != -1UL && my_row[i] < remote_row[r_idx[i]]) {
+					my_row[i] = remote_row[r_idx[i]];
+					touch(m);
+					updated = true;
 				}
-			updated |= n.second.netmsgcnt < rptr->second.netmsgcnt;
-			n.second.netmsgcnt = max(n.second.netmsgcnt, rptr->second.netmsgcnt);
-			n.second.proto_ver = max(n.second.proto_ver, rptr->second.proto_ver);
+			updated |= n.second.netmsgcnt < rn.netmsgcnt;
+			n.second.netmsgcnt = max(n.second.netmsgcnt, rn.netmsgcnt);
+			n.second.proto_ver = max(n.second.proto_ver, rn.proto_ver);
 		}
 		m++;
 	}
 	return updated;
 }
 
+bool Matrix::update(const MatrixDelta& src)
+{
+	bool updated = false;
+	const vector<UUID>& ids = *src.ids;
+	vector<ssize_t> idx; // local offsets of source nodes
+	idx.reserve(ids.size());
+	for (const UUID& id : ids)
+		idx.push_back(node_offset(id));
+	for (const MatrixDelta::Row& r : src.rows) {
+		if (idx[r.node] == -1)
+			continue;
+		Node& n = find(ids[r.node])->second;
+		for (const auto& c : r.cells)
+			if (idx[c.first] != -1 && n.matrix_row[idx[c.first]] < c.second) {
+				n.matrix_row[idx[c.first]] = c.second;
+				touch(idx[r.node]);
+				updated = true;
+			}
+		updated |= n.netmsgcnt < r.netmsgcnt;
+		n.netmsgcnt = max(n.netmsgcnt, r.netmsgcnt);
+		n.proto_ver = max(n.proto_ver, r.proto_ver);
+	}
+	return updated;
+}
+
 void Matrix::resize(const UUID& remote_id, const Node* from_node, short proto_ver)
 {
 	vector<UUID> vid = {remote_id};
@@ -420,6 +960,7 @@ void Matrix::resize(vector<UUID>& remote_ids, const Node* from_node, short proto
 {
 	sort(remote_ids.begin(), remote_ids.end());
 	vector<UUID> my_ids;
+	my_ids.reserve(size());
 	for (const auto& n : *this)
 		my_ids.push_back(n.first);
 	size_t M = my_ids.size(); // number of my nodes
@@ -428,7 +969,7 @@ void Matrix::resize(vector<UUID>& remote_ids, const Node* from_node, short proto
 
 	vector<UUID> all_ids;
 	all_ids.reserve(R + M);
-	set_union(my_ids.begin(), my_ids.end(), &remote_ids[0], &remote_ids[R], back_inserter(all_ids));
+	set_union(my_ids.begin(), my_ids.end(), remote_ids.begin(), remote_ids.end(), back_inserter(all_ids));
 	size_t U = all_ids.size(); // number of united nodes
 
 	vector<ssize_t> m_idx(U); // indexes in my row
@@ -441,30 +982,28 @@ void Matrix::resize(vector<UUID>& remote_ids, const Node* from_node, short proto
 				m_idx[i] = -1L;
 	}
 
-	// Unite: fill 'uni' matrix
+	// Unite: fill 'uni' matrix. from_node may be row of this matrix, so old cells are kept till end
 	vector<size_t> uni(U * U); //united matrix
 	for (size_t i = 0; i < U; i++) {
 		const size_t * my_row = nullptr;
 		if (m_idx[i] != -1L)
-			my_row = (map<UUID, Node>::operator[])(my_ids[m_idx[i]]).matrix_row.data();
+			my_row = &cells[m_idx[i] * M];
 		else if (from_node)
 			my_row = from_node->matrix_row.data();
 
-		for (size_t j = 0; j < U; j++) {
-			size_t a = 0;
-			if (my_row && m_idx[j] != -1L)
-				a = my_row[m_idx[j]];
-			uni[i * U + j] = a;
-		}
+		if (my_row)
+			for (size_t j = 0; j < U; j++)
+				if (m_idx[j] != -1L)
+					uni[i * U + j] = my_row[m_idx[j]];
 	}
 
 	// Save results
-	for (size_t i = 0; i < U; i++)
-		(map<UUID, Node>::operator[])(all_ids[i]).matrix_row = vector(&uni[i * U], &uni[i * U + U]);
 	for (const UUID& id : remote_ids) {
 		Node& n = (map<UUID, Node>::operator[])(id);
 		n.proto_ver = proto_ver;
 	}
+	cells = move(uni);
+	rebind();
 }
 
 Matrix Matrix::load_nodes(const Json::Value& src)
@@ -474,29 +1013,45 @@ Matrix Matrix::load_nodes(const Json::Value& src)
 		for (Json::ValueConstIterator it = src.begin(); it != src.end(); ++it)
 			res.emplace(it.key(), *it);
 	size_t len = res.size();
-	for (const auto& n : res)
-		if (n.second.matrix_row.size() != len)
+	res.cells.assign(len * len, 0);
+	res.rebind();
+	for (Json::ValueConstIterator it = src.begin(); len && it != src.end(); ++it) {
+		const Json::Value& jrow = (*it)["row"];
+		if (!jrow.isArray() || jrow.size() != len)
 			throw exc_error(_("Node file damaged"));
+		MatrixRow& row = res[UUID(it.key())].matrix_row;
+		for (Json::ArrayIndex i = 0; i < len; i++)
+			row[i] = jrow[i].asUInt64();
+	}
 	return res;
 }
 
 void Matrix::del(const UUID& id)
 {
-	auto p = find(id);
-	if (p == end())
+	ssize_t d = node_offset(id);
+	if (d == -1)
 		return;
-	size_t d = distance(begin(), p);
-	erase(p);
-	for (auto& i : *this)
-		i.second.matrix_row.erase(i.second.matrix_row.begin() + d);
+	const size_t N = size();
+	size_t * p = cells.data();
+	for (size_t i = 0; i < N; i++) {
+		if (i == (size_t)d)
+			continue;
+		const size_t * row = &cells[i * N];
+		for (size_t j = 0; j < N; j++)
+			if (j != (size_t)d)
+				*p++ = row[j];
+	}
+	cells.resize((N - 1) * (N - 1));
+	erase(id);
+	rebind();
 }
 
 ssize_t Matrix::node_offset(const UUID& id) const
 {
-	auto n = find(id);
-	if (n == end())
+	auto n = index.find(id);
+	if (n == index.end())
 		return -1;
-	return distance(begin(), n);
+	return n->second;
 }
 
 // ===== Core =====
@@ -538,6 +1093,7 @@ string CoreBase::unix_socket_name_lp() const
 Core::Core(Config& c) : CoreBase(c)
 {
 	core = this;
+	Msg::storage = &msglog;
 }
 
 void Core::load()
@@ -546,25 +1102,18 @@ void Core::load()
 	bool created = load_group_id();
 	if (created)
 		return;
-	const Json::Value js = load_local_state();
-	if (js.isObject()) {
-		my_id = js["local-id"];
-		status = load_status(js["status"]);
-		state_nodes = js["nodes"];
-		state = js["state"];
-		nodes = Matrix::load_nodes(state_nodes);
-		messages = load_messages(js["commands"]);
-		users = Usernames(js["users"]);
-		filenames = load_filenames(js["filenames"]);
-		invite_id = js["invite-id"];
-		valid_node = asBool(js["valid-node"]);
-	}
+	msglog.open(cfg.workdir() + "/msgs");
+	load_local_state();
+	load_journal();
+	snapshot_nodes();
+	ref_messages();
 	auto p = nodes.find(my_id);
 	if (p == nodes.end())
 		return;
 	my_node = &nodes[my_id];
 	my_node->hash = calc_my_hash();
 	my_node->proto_ver = protocol_version;
+	my_node->netmsgcnt = max(my_node->netmsgcnt, netmsgcnt_reserved);
 	check_matrix();
 }
 
@@ -595,7 +1144,6 @@ bool Core::create_group()
 	nodes.create(my_id);
 	my_node = &nodes[my_id];
 	my_node->hash = calc_my_hash();
-	my_node->matrix_row.push_back(0);
 	my_node->proto_ver = protocol_version;
 
 	const string filename = cfg.workdir() + "/group-id";
@@ -605,6 +1153,7 @@ bool Core::create_group()
 	cfg.force_yes = true;
 	status = NodeStatus::work;
 	valid_node = true;
+	need_checkpoint = true;
 	return true;
 }
 
@@ -620,40 +1169,188 @@ void Core::save_group_id(const string& filename) const
 		throw exc_errno(_("Error write file"), filename);
 }
 
-Json::Value Core::load_local_state()
+void Core::load_local_state()
 {
 	try {
-		return load_local_state(cfg.workdir() + "/node");
+		load_local_state(cfg.workdir() + "/node");
+		return;
 	} catch (const exception&) {}
 	warn << _("Save file damaged. Load from backup.");
 	load_from_bkup = true;
-	return load_local_state(cfg.workdir() + "/node~");
+	load_local_state(cfg.workdir() + "/node~");
 }
 
-Json::Value Core::load_local_state(const string& filename)
+void Core::load_local_state(const string& filename)
 {
-	Json::Value res;
+	if (Checkpoint::detect(filename)) {
+		load_checkpoint(filename);
+		return;
+	}
+	Json::Value js;
 	ifstream f(filename);
 	if (f) {
-		f >> res;
+		f >> js;
 		if (!f)
 			throw exc_errno(_("Error read file"), filename);
+		import_state(js);
 	} else {
 		if (!prompt_yn(("Node file not found. Do you want to create new?")))
 			throw exc_error(_("Node file not found"));
 		my_id.clear();
 		status = NodeStatus::uninitialized;
 	}
-	return res;
 }
 
-set<Msg> Core::load_messages(const Json::Value& src)
+// Remove values which are kept in Matrix from node info
+static void strip_node(Json::Value& n)
+{
+	n.removeMember("row");
+	n.removeMember("cmd");
+	n.removeMember("netmsgcnt");
+	n.removeMember("proto-ver");
+}
+
+void Core::load_checkpoint(const string& filename)
+{
+	Checkpoint cp(filename);
+	const CheckpointHeader& h = cp.header();
+	const Json::Value js = cp.other();
+	my_id = h.my_id;
+	status = cp.status();
+	valid_node = h.valid_node;
+	invite_id = h.invite_id;
+	generation = h.generation;
+	nodes = cp.nodes();
+	messages = cp.messages();
+	state_nodes = js["nodes"];
+	state = js["state"];
+	users = Usernames(js["users"]);
+	filenames = load_filenames(js["filenames"]);
+	netmsgcnt_reserved = js["netmsgcnt-reserved"].asUInt64();
+	saved_exec = static_cast<const Json::Value&>(state)["exec"].size();
+}
+
+void Core::import_state(const Json::Value& js)
+{
+	if (!js.isObject())
+		return;
+	my_id = js["local-id"];
+	status = load_status(js["status"]);
+	state_nodes = js["nodes"];
+	state = js["state"];
+	nodes = Matrix::load_nodes(state_nodes);
+	for (auto& n : state_nodes)
+		strip_node(n);
+	messages = load_messages(js["commands"]);
+	for (const Msg& m : messages)
+		journal_add(m);
+	users = Usernames(js["users"]);
+	filenames = load_filenames(js["filenames"]);
+	invite_id = js["invite-id"];
+	valid_node = asBool(js["valid-node"]);
+	if (js["generation"].isUInt64())
+		generation = js["generation"].asUInt64();
+	if (js["netmsgcnt-reserved"].isUInt64())
+		netmsgcnt_reserved = js["netmsgcnt-reserved"].asUInt64();
+	saved_exec = static_cast<const Json::Value&>(state)["exec"].size();
+}
+
+void Core::load_journal()
+{
+	if (!generation)
+		return;
+	const string filename = cfg.workdir() + "/journal";
+	checkpoint_size = fs::file_size(cfg.workdir() + (load_from_bkup ? "/node~" : "/node"));
+	vector<Json::Value> recs = journal.load(filename, generation);
+	for (const Json::Value& rec : recs)
+		load_journal_record(rec);
+	if (!recs.empty())
+		debug << recs.size() << " journal records loaded";
+	journal.open(filename, generation);
+}
+
+void Core::load_journal_record(const Json::Value& rec)
+{
+	my_id = rec["local-id"];
+	valid_node = asBool(rec["valid-node"]);
+	status = load_status(rec["status"]);
+	invite_id = rec["invite-id"];
+	if (rec.isMember("nodes")) {
+		state_nodes = rec["nodes"];
+		nodes = Matrix::load_nodes(state_nodes);
+		for (auto& n : state_nodes)
+			strip_node(n);
+	}
+	const Json::Value& chn = rec["nodes-changes"];
+	for (auto it = chn.begin(); it != chn.end(); ++it) {
+		const UUID id(it.key());
+		auto p = nodes.find(id);
+		const Json::Value& cells = (*it)["cells"];
+		if (p == nodes.end() || cells.size() % 2)
+			throw exc_error(_("Node file damaged"));
+		Node& n = p->second;
+		for (Json::ArrayIndex i = 0; i < cells.size(); i += 2) {
+			size_t j = cells[i].asUInt64();
+			if (j >= nodes.size())
+				throw exc_error(_("Node file damaged"));
+			n.matrix_row[j] = cells[i + 1].asUInt64();
+		}
+		nodes.touch(id);
+		const Node src(*it);
+		n.command_to_exec = src.command_to_exec;
+		n.netmsgcnt = src.netmsgcnt;
+		n.proto_ver = src.proto_ver;
+		Json::Value& info = state_nodes[it.name()] = *it;
+		info.removeMember("cells");
+		strip_node(info);
+	}
+
+	const Json::Value& del = rec["del"];
+	for (Json::ArrayIndex i = 0; i < del.size(); i++)
+		messages.erase(MsgId(del[i]));
+	const Json::Value& add = rec["add"];
+	for (Json::ArrayIndex i = 0; i < add.size(); i++) {
+		const Json::Value& a = add[i];
+		if (a.isMember("value")) {
+			// Old journal with command bodies
+			auto p = messages.insert(Msg(a));
+			journal_add(*p.first);
+			continue;
+		}
+		Msg m{MsgId(a)};
+		m.loc.segment = a["segment"].asUInt64();
+		m.loc.offset = a["offset"].asUInt64();
+		m.loc.size = a["size"].asUInt64();
+		m.set_name(a["name"].asString());
+		const Json::Value& d = a["depends"];
+		for (auto i = d.begin(); i != d.end(); i++)
+			m.depends[UUID(i.key())] = i->asUInt64();
+		m.unload();
+		messages.insert(move(m));
+	}
+
+	if (rec.isMember("state"))
+		state = rec["state"];
+	const Json::Value& exec = rec["exec"];
+	for (Json::ArrayIndex i = 0; i < exec.size(); i++)
+		state["exec"].append(exec[i]);
+	saved_exec = static_cast<const Json::Value&>(state)["exec"].size();
+
+	if (rec.isMember("users"))
+		users = Usernames(rec["users"]);
+	if (rec.isMember("filenames"))
+		filenames = load_filenames(rec["filenames"]);
+	if (rec.isMember("netmsgcnt-reserved"))
+		netmsgcnt_reserved = rec["netmsgcnt-reserved"].asUInt64();
+}
+
+MsgStore Core::load_messages(const Json::Value& src)
 {
-	set<Msg> res;
+	MsgStore res;
 	if (src.isArray()) {
 		const Json::ArrayIndex n = src.size();
 		for (Json::ArrayIndex i = 0; i < n; i++)
-			res.emplace(src[i]);
+			res.insert(Msg(src[i]));
 	}
 	return res;
 }
@@ -688,9 +1385,105 @@ NodeStatus Core::load_status(const Json::Value& src)
 
 void Core::save(bool force)
 {
-	if (!need_save && !force)
+	if (saving) {
+		// Other thread is writing previous changes, it will save again
+		save_deferred = true;
+		need_save |= force;
+		return;
+	}
+	SaveJob job;
+	if (!prepare_save(job, force))
 		return;
+	try {
+		write_save(job);
+	} catch (...) {
+		finish_save(job, false);
+		throw;
+	}
+	finish_save(job, true);
+}
+
+bool Core::prepare_save(SaveJob& job, bool force)
+{
+	if (!need_save && !force)
+		return false;
 	need_save = false;
+	saving = true;
+	job.stored = flush_messages();
+	job.bodies = msglog.take_writes();
+	job.checkpoint = need_checkpoint || !journal.is_open() || journal.size() > max(checkpoint_size, journal_min_size);
+	if (job.checkpoint)
+		prepare_checkpoint(job);
+	else
+		prepare_journal(job);
+	clear_changes();
+	return true;
+}
+
+void Core::write_save(SaveJob& job)
+{
+	MsgLog::write(job.bodies);
+	if (job.checkpoint) {
+		Checkpoint::write(cfg.workdir() + "/node", job.data, !load_from_bkup);
+		journal.reset(cfg.workdir() + "/journal", job.generation);
+	} else
+		journal.append(job.record);
+}
+
+bool Core::finish_save(const SaveJob& job, bool ok)
+{
+	saving = false;
+	bool again = save_deferred;
+	save_deferred = false;
+	if (!ok) {
+		// Save everything again, do not rely on data which is not written
+		msglog.close_appends();
+		for (const MsgId& id : job.stored) {
+			const Msg * m = find_command(id);
+			if (!m || !m->loc.stored())
+				continue;
+			msglog.unref(m->node_id, m->loc);
+			m->loc = MsgLocation();
+			added_msgs.insert(id);
+		}
+		need_checkpoint = true;
+		need_save = true;
+		return again;
+	}
+	if (job.checkpoint) {
+		generation = job.generation;
+		checkpoint_size = job.data.size();
+	}
+	msglog.collect();
+	// Bodies of written commands are in message log now
+	for (const MsgId& id : job.stored)
+		if (const Msg * m = find_command(id))
+			m->unload();
+	debug << _("Saved");
+	return again;
+}
+
+void Core::prepare_checkpoint(SaveJob& job)
+{
+	Json::Value json;
+	save_nodes();
+	json["nodes"] = state_nodes;
+	json["state"] = state;
+	json["users"] = users.as_json();
+	json["filenames"] = save_filenames();
+	json["netmsgcnt-reserved"] = netmsgcnt_reserved;
+	CheckpointHeader h;
+	h.generation = job.generation = generation + 1;
+	h.my_id = my_id;
+	h.status = (uint8_t)status;
+	h.valid_node = valid_node;
+	h.invite_id = status == NodeStatus::inviter ? invite_id : UUID::none();
+	job.data = Checkpoint::encode(h, nodes, messages, json);
+	snapshot_nodes();
+}
+
+Json::Value Core::export_state()
+{
 	Json::Value json;
 	json["local-id"] = string(my_id);
 	json["valid-node"] = valid_node;
@@ -702,19 +1495,115 @@ void Core::save(bool force)
 	json["filenames"] = save_filenames();
 	if (status == NodeStatus::inviter)
 		json["invite-id"] = string(invite_id);
-	const string filename = cfg.workdir() + "/node";
-	if (!load_from_bkup)
-		try {
-			fs::rename(filename, filename + '~');
-		} catch(...){}
-	create_safe_file(filename);
-	ofstream f(filename);
-	if (!f)
-		throw exc_errno(_("Error open file"), filename);
-	write_string(json, f);
-	if (!f)
-		throw exc_errno(_("Error save file"), filename);
-	debug << _("Saved");
+	json["netmsgcnt-reserved"] = netmsgcnt_reserved;
+	return json;
+}
+
+void Core::prepare_journal(SaveJob& job)
+{
+	Json::Value& rec = job.record;
+	rec["local-id"] = string(my_id);
+	rec["valid-node"] = valid_node;
+	rec["status"] = status_string();
+	if (status == NodeStatus::inviter)
+		rec["invite-id"] = string(invite_id);
+	// Whole matrix is written only when nodes are added or deleted
+	if (saved_layout != nodes.layout()) {
+		rec["nodes"] = save_nodes();
+		snapshot_nodes();
+	} else {
+		Json::Value chn = save_nodes_changes();
+		if (!chn.empty())
+			rec["nodes-changes"] = move(chn);
+	}
+	for (const MsgId& id : deleted_msgs) {
+		Json::Value d;
+		d["author_id"] = string(id.node_id);
+		d["number"] = id.msg_number;
+		rec["del"].append(d);
+	}
+	for (const MsgId& id : added_msgs) {
+		const Msg * m = find_command(id);
+		if (!m)
+			continue;
+		Json::Value a;
+		a["author_id"] = string(m->node_id);
+		a["number"] = m->msg_number;
+		a["segment"] = m->loc.segment;
+		a["offset"] = m->loc.offset;
+		a["size"] = m->loc.size;
+		a["name"] = m->name;
+		Json::Value& d = a["depends"];
+		for (const auto& i : m->depends)
+			d[string(i.first)] = i.second;
+		rec["add"].append(a);
+	}
+	const Json::Value& exec = static_cast<const Json::Value&>(state)["exec"];
+	if (state_changed)
+		rec["state"] = state;
+	else
+		for (Json::ArrayIndex i = saved_exec; i < exec.size(); i++)
+			rec["exec"].append(exec[i]);
+	if (users_changed)
+		rec["users"] = users.as_json();
+	if (filenames_changed)
+		rec["filenames"] = save_filenames();
+	rec["netmsgcnt-reserved"] = netmsgcnt_reserved;
+}
+
+void Core::journal_add(const MsgId& id)
+{
+	added_msgs.insert(id);
+}
+
+void Core::journal_del(const Msg& m)
+{
+	if (m.loc.stored())
+		msglog.unref(m.node_id, m.loc);
+	if (!added_msgs.erase(m))
+		deleted_msgs.insert(m);
+}
+
+vector<MsgId> Core::flush_messages()
+{
+	vector<MsgId> res;
+	msglog.open(cfg.workdir() + "/msgs");
+	for (const MsgId& id : added_msgs) {
+		const Msg * m = find_command(id);
+		if (m && !m->loc.stored()) {
+			m->loc = msglog.append(m->node_id, m->body());
+			res.push_back(id);
+		}
+	}
+	return res;
+}
+
+void Core::ref_messages()
+{
+	for (const Msg& m : messages)
+		if (m.loc.stored())
+			msglog.ref(m.node_id, m.loc);
+}
+
+void Core::clear_messages()
+{
+	for (const Msg& m : messages)
+		if (m.loc.stored())
+			msglog.unref(m.node_id, m.loc);
+	messages.clear();
+	added_msgs.clear();
+	deleted_msgs.clear();
+}
+
+void Core::clear_changes()
+{
+	added_msgs.clear();
+	deleted_msgs.clear();
+	saved_exec = static_cast<const Json::Value&>(state)["exec"].size();
+	need_checkpoint = false;
+	state_changed = false;
+	users_changed = false;
+	filenames_changed = false;
 }
 
 
@@ -739,11 +1628,37 @@ GroupIdPacket Core::read_group_id(Istream& ff, const std::string& passwd)
 	f.read(&pv, sizeof(pv));
 	f.read(&nid, sizeof(nid));
 	f.check_hash();
-	if (pv != protocol_version)
+	if (pv != group_id_version)
 		throw exc_error(_("Bad protocol version"));
 	return nid;
 }
 
+/* Version of data to initialize new node, see Core::write_initializer()
+ * 2 - matrix is written by Matrix::write_compact() */
+static short initializer_version(short proto_ver)
+{
+	return proto_ver >= 3 ? 2 : 1;
+}
+
+// Read beginning of initializer. Return its version
+static short read_initializer_head(ICCstream& f, UUID& from_id)
+{
+	short version = 1;
+	f.read(&from_id, sizeof(from_id));
+	if (!from_id) {
+		f.read(&version, sizeof(version));
+		if (version != 2)
+			throw exc_error(_("Bad protocol version"));
+		f.read(&from_id, sizeof(from_id));
+	}
+	return version;
+}
+
+static Matrix read_initializer_matrix(ICCstream& f, short version)
+{
+	return version >= 2 ? Matrix::read_compact(f, true) : Matrix::read_vld(f);
+}
+
 void Core::write_group_id(Ostream& of, const string& passwd) const
 {
 	GroupIdPacket nid;
@@ -765,20 +1680,20 @@ void Core::write_group_id(Ostream& of, const string& passwd) const
 
 	of.write(&nonce, sizeof(nonce));
 	OCstream f(of, pwd_key, nonce);
-	f.write(&protocol_version, sizeof(protocol_version));
+	f.write(&group_id_version, sizeof(group_id_version));
 	f.write(&nid, sizeof(nid));
 	f.write_hash();
 }
 
-set<Msg> Core::read_messages(ICCstream& f)
+MsgStore Core::read_messages(ICCstream& f)
 {
 	size_t cmd_size;
-	set<Msg> res;
+	MsgStore res;
 	f.read(&cmd_size, sizeof(cmd_size));
 	f.check_hash();
 	for (size_t i = 0; i < cmd_size; i++) {
 		Json::Value j = f.read_json();
-		res.emplace(j);
+		res.insert(Msg(j));
 	}
 	f.check_hash();
 	return res;
@@ -789,8 +1704,10 @@ void Core::write_messages(OCCstream& f) const
 	size_t cmd_size = messages.size();
 	f.write(&cmd_size, sizeof(cmd_size));
 	f.write_hash();
-	for (const Msg& m : messages)
-		f.write_json(m.as_json());
+	for (const Msg& m : messages) {
+		f.write_string(m.encoded());
+		m.unload();
+	}
 	f.write_hash();
 }
 
@@ -814,15 +1731,24 @@ bool Core::write_offline_invite(const string& filename, const string& passwd)
 	OCCstream f(f1, crypt_key);
 	invite_id.random(rnd);
 	f.write(&invite_id, sizeof(invite_id));
-	write_initializer_v1(f);
+	write_initializer(f, initializer_version(max_proto_ver()));
 	status = NodeStatus::inviter;
 	return true;
 }
 
-void Core::write_initializer_v1(OCCstream& f)
+void Core::write_initializer(OCCstream& f, short version)
 {
+	// Version 1 has no version field, it begins with id of this node
+	if (version >= 2) {
+		const UUID none = UUID::none();
+		f.write(&none, sizeof(none));
+		f.write(&version, sizeof(version));
+	}
 	f.write(&my_id, sizeof(my_id));
-	nodes.write_vld(f);
+	if (version >= 2)
+		nodes.write_compact(f, true);
+	else
+		nodes.write_vld(f);
 	f.write_json(state_nodes);
 	f.write_json(state);
 	write_messages(f);
@@ -862,9 +1788,10 @@ void Core::read_online_invite(const string& filename, const string& passwd)
 	state_nodes = Json::Value();
 	state = Json::Value();
 	nodes.clear();
-	messages.clear();
+	clear_messages();
 	users.clear();
 	filenames.clear();
+	need_checkpoint = true;
 	fs::remove_all(cfg.filesdir());
 	save_group_id(cfg.workdir() + "/group-id");
 }
@@ -879,7 +1806,7 @@ void Core::read_offline_invite(const string& filename, const string& passwd)
 	ICCstream f(f1, crypt_key);
 	UUID tmp;
 	f.read(&tmp, sizeof(tmp));
-	UUID from_id = read_initializer_v1(f);
+	UUID from_id = read_initializer(f);
 	f.close();
 	save_group_id(cfg.workdir() + "/group-id");
 	status = NodeStatus::part_init;
@@ -908,14 +1835,14 @@ void Core::read_offline_invite(const string& filename, const string& passwd)
 	write_trailer_uuids(of, trl);
 }
 
-UUID Core::read_initializer_v1(ICCstream& f)
+UUID Core::read_initializer(ICCstream& f)
 {
 	UUID from_id;
-	f.read(&from_id, sizeof(from_id));
-	Matrix mtx = Matrix::read_vld(f);
+	short version = read_initializer_head(f, from_id);
+	Matrix mtx = read_initializer_matrix(f, version);
 	Json::Value stn = f.read_json();
 	Json::Value stt = f.read_json();
-	set<Msg> cmds = read_messages(f);
+	MsgStore cmds = read_messages(f);
 	Usernames usrs(f.read_json());
 	set<string> filnames = load_filenames(f.read_json());
 	TmpDir tmpdir(cfg.tmpfilesdir());
@@ -925,9 +1852,13 @@ UUID Core::read_initializer_v1(ICCstream& f)
 	state_nodes = stn;
 	state = stt;
 	nodes = mtx;
+	clear_messages();
 	messages = cmds;
+	for (const Msg& m : messages)
+		journal_add(m);
 	users.replace(move(usrs));
 	filenames = filnames;
+	need_checkpoint = true;
 	tmpdir.store_files(cfg.filesdir());
 	cwd();
 	return from_id;
@@ -937,7 +1868,7 @@ void Core::read_net_initializer(ICCstream& sin, OCCstream& sout, const UUID& rem
 {
 	if (!my_id)
 		my_id.random(rnd);
-	UUID from_id = read_initializer_v1(sin);
+	UUID from_id = read_initializer(sin);
 	char ok;
 	do {
 		while (nodes.find(my_id) != nodes.end())
@@ -972,8 +1903,7 @@ void Core::finalize_offline_invitation(const string& filename)
 	f.read(&init_id, sizeof(init_id));
 	if (invite_id != init_id)
 		throw exc_error(_("Wrong file"));
-	f.read(&init_id, sizeof(init_id));
-	Matrix::read_vld(f);
+	read_initializer_matrix(f, read_initializer_head(f, init_id));
 	f.read_json(); // state_nodes
 	f.read_json(); // state
 	read_messages(f);
@@ -1036,6 +1966,8 @@ void Core::write_trailer_uuids(Ostream& f, const TrailerUUIDs& trl) const
 
 SHA256 Core::calc_my_hash() const
 {
+	if (max_proto_ver() >= 4)
+		return nodes.hash();
 	SHA256_CTX ctx;
 	SHA256_Init(&ctx);
 	for(const auto& i : nodes) {
@@ -1056,15 +1988,61 @@ const string& Core::status_string() const
 		throw exc_error("Internal error: bad node status");
 }
 
-Json::Value& Core::save_nodes()
+Json::Value Core::save_nodes()
 {
-	Json::Value res;
+	Json::Value info, res;
 	for(const auto& p : nodes) {
 		string id = p.first;
-		res[id] = state_nodes[id];
+		info[id] = state_nodes[id];
+		res[id] = info[id];
 		p.second.update(res[id]);
 	}
-	return state_nodes = res;
+	state_nodes = move(info);
+	return res;
+}
+
+Json::Value Core::save_nodes_changes()
+{
+	Json::Value res = Json::objectValue;
+	const vector<char> changed = nodes.take_changed();
+	const size_t N = nodes.size();
+	auto s = saved_nodes.begin();
+	size_t i = 0;
+	for (const auto& p : nodes) {
+		const Node& n = p.second;
+		Node& sn = s->second;
+		Json::Value cells = Json::arrayValue;
+		if (changed[i])
+			for (size_t j = 0; j < N; j++)
+				if (n.matrix_row[j] != sn.matrix_row[j]) {
+					cells.append(j);
+					cells.append(n.matrix_row[j]);
+					sn.matrix_row[j] = n.matrix_row[j];
+				}
+		if (!cells.empty() || changed_nodes.count(p.first) || n.command_to_exec != sn.command_to_exec ||
+				n.netmsgcnt != sn.netmsgcnt || n.proto_ver != sn.proto_ver) {
+			string id = p.first;
+			Json::Value& r = res[id] = state_nodes[id];
+			n.update(r, false);
+			if (!cells.empty())
+				r["cells"] = move(cells);
+			sn.command_to_exec = n.command_to_exec;
+			sn.netmsgcnt = n.netmsgcnt;
+			sn.proto_ver = n.proto_ver;
+		}
+		s++;
+		i++;
+	}
+	changed_nodes.clear();
+	return res;
+}
+
+void Core::snapshot_nodes()
+{
+	saved_nodes = nodes;
+	saved_layout = nodes.layout();
+	nodes.take_changed();
+	changed_nodes.clear();
 }
 
 Json::Value Core::save_filenames() const
@@ -1078,24 +2056,43 @@ Json::Value Core::save_filenames() const
 Json::Value Core::save_commands() const
 {
 	Json::Value res;
-	for(const auto& p : messages)
+	for(const auto& p : messages) {
 		res.append(p.as_json());
+		p.unload();
+	}
 	return res;
 }
 
 void Core::create_command(Json::Value&& json, bool add_depends)
+{
+	Msg cmd(my_id, 0);
+	cmd.set_value(move(json));
+	create_command(move(cmd), add_depends);
+}
+
+void Core::create_command(StateCmd&& state)
+{
+	Msg cmd(my_id, 0);
+	cmd.set_state(move(state));
+	create_command(move(cmd), false);
+}
+
+void Core::create_command(Msg&& cmd, bool add_depends)
 {
 	if (status != NodeStatus::work && status != NodeStatus::inviter) {
 		warn << _("Node is not initialized");
 		return;
 	}
-	Msg cmd(my_id, my_node->matrix_row[nodes.node_offset(my_id)]++);
-	cmd.value = move(json);
-	debug << _("New command") << ' ' << cmd.value["name"];
+	cmd.msg_number = my_node->matrix_row[nodes.node_offset(my_id)]++;
+	nodes.touch(my_id);
+	debug << _("New command") << ' ' << cmd.name;
 	if (add_depends)
 		for (const auto& n : nodes)
 			cmd.depends[n.first] = n.second.command_to_exec;
-	messages.insert(move(cmd));
+	journal_add(cmd);
+	auto p = messages.insert(move(cmd));
+	if (exec_queue)
+		exec_queue->add(p.first);
 	need_save = true;
 }
 
@@ -1103,46 +2100,67 @@ bool Core::execute_pending_commands()
 {
 	bool res = false;
 	debug << "Execute pending commands";
-	for (;;) {
-		const Msg * cmdp = command_to_exec();
-		if (!cmdp)
-			break;
-		debug << "Exec: " << cmdp->value["name"];
-		const Msg& cmd = *cmdp;
-		exec(cmd);
-		mark_as_executed(cmd);
-		need_save = true;
-		res = true;
+	ExecQueue queue(messages, nodes, exec_running);
+	exec_queue = &queue;
+	try {
+		for (;;) {
+			vector<const Msg *> ready = queue.take();
+			if (ready.empty())
+				break;
+			// Consecutive addnode commands (e.g. after offline invite) resize matrix once
+			if (any_of(ready.begin(), ready.end(), [](const Msg * m) { return m->name != "addnode"; }))
+				add_new_nodes();
+			vector<const Msg *> cmds;
+			for (const Msg * m : ready)
+				if (!exec_background(*m))
+					cmds.push_back(m);
+			// Commands are independent, so external programs are run together
+			vector<ExecOutput> outs = exec_parallel(cmds);
+			vector<MsgId> ids;
+			for (const Msg * m : cmds)
+				ids.push_back(*m);
+			for (size_t i = 0; i < cmds.size(); i++) {
+				if (!queue.valid(messages, nodes)) {
+					/* Previous command changed messages or nodes: this one
+					 * may be deleted or its author may be gone */
+					cmds[i] = find_command(ids[i]);
+					auto n = nodes.find(ids[i].node_id);
+					if (!cmds[i] || n == nodes.end() || n->second.command_to_exec != ids[i].msg_number)
+						continue;
+				}
+				const Msg& cmd = *cmds[i];
+				debug << "Exec: " << cmd.name;
+				if (outs[i].run)
+					exec_output(cmd, outs[i]);
+				else
+					exec(cmd);
+				mark_as_executed(cmd);
+				need_save = true;
+				res = true;
+				if (queue.valid(messages, nodes))
+					queue.executed(cmd.node_id);
+			}
+			if (!queue.valid(messages, nodes))
+				queue = ExecQueue(messages, nodes, exec_running); // Command changed messages or nodes
+		}
+	} catch (...) {
+		exec_queue = nullptr;
+		add_new_nodes();
+		throw;
 	}
+	exec_queue = nullptr;
+	add_new_nodes();
 	return res;
 }
 
-const Msg * Core::command_to_exec() const
+void Core::add_new_nodes()
 {
-	vector<const Msg *> vres;
-	for(const Msg& m : messages) {
-		auto n = nodes.find(m.node_id);
-		if (n == nodes.end())
-			continue;
-		if (n->second.command_to_exec != m.msg_number)
-			continue;
-		bool ok = true;
-		for (const auto& i : m.depends) {
-			auto p = nodes.find(i.first);
-			if (p == nodes.end())
-				continue;
-			if (p->second.command_to_exec < i.second) {
-				ok = false;
-				break;
-			}
-		}
-		if (ok)
-			vres.push_back(&m);
-	}
-	if (vres.empty())
-		return nullptr;
-	uniform_int_distribution<size_t> dist(0, vres.size() - 1);
-	return vres[dist(rd)];
+	if (new_nodes.empty())
+		return;
+	sort(new_nodes.begin(), new_nodes.end());
+	new_nodes.erase(unique(new_nodes.begin(), new_nodes.end()), new_nodes.end());
+	nodes.resize(new_nodes, nullptr, max_proto_ver());
+	new_nodes.clear();
 }
 
 void Core::mark_as_executed(const Msg& cmd)
@@ -1155,44 +2173,38 @@ void Core::mark_as_executed(const Msg& cmd)
 		return;
 	}
 	p->second.command_to_exec++;
+	// Body is read from message log again if it is needed
+	cmd.unload();
 }
 
 void Core::remove_old_commands()
 {
 	if (status == NodeStatus::inviter)
 		return;
-	set<UUID> ign_nodes;
-	for (const Msg& cmd : messages)
-		if (cmd.value["name"] == "delnode" && cmd.value["force"] == true)
-			ign_nodes.insert(cmd.value["val"]);
+	// Commands known and executed by every node (except force deleted) are collected
 	vector<size_t> level(nodes.size(), -1UL);
 	size_t i = 0;
 	for (const auto& n : nodes) {
-		if (ign_nodes.contains(n.first))
-			continue;
-		for (size_t j = 0; j < n.second.matrix_row.size(); j++)
-			level[j] = min(level[j], n.second.matrix_row[j]);
-		level[i] = min(level[i], n.second.command_to_exec);
+		if (!messages.force_deleted(n.first)) {
+			row_min(level.data(), n.second.matrix_row.data(), level.size());
+			level[i] = min(level[i], n.second.command_to_exec);
+		}
 		i++;
 	}
-	map<UUID, size_t> b;
-	i = 0;
-	for (const auto& n : nodes)
-		b[n.first] = level[i++];
 
-	for (const Msg& m : messages)
-		if (nodes.find(m.node_id) == nodes.end() || m.msg_number < b[m.node_id]) {
+	// Only collected prefix of each author is visited
+	for (const UUID& a : messages.authors()) {
+		ssize_t x = nodes.node_offset(a);
+		messages.truncate(a, x == -1 ? -1UL : level[x], [this](const Msg& m) {
 			try {
 				before_delete_message(m);
 			} catch(const exception& e) {
 				warnln << _("Bad command found") << ' ' << e.what();
 			}
-			m.delete_flag = true;
+			journal_del(m);
 			need_save = true;
-		} else
-			m.delete_flag = false;
-
-	erase_if(messages, [&b](const Msg& m) { return m.delete_flag; });
+		});
+	}
 }
 
 void Core::del_self()
@@ -1210,18 +2222,14 @@ void Core::notify() const
 vector<const Msg*> Core::commands_to_write(const set<UUID>& dest_nodes) const
 {
 	size_t size = nodes.size();
-	vector<size_t> min_nums(size);
-	for (size_t i = 0; i < size; i++)
-		min_nums[i] = my_node->matrix_row[i];
+	vector<size_t> min_nums = my_node->matrix_row;
 	for (const UUID& id : dest_nodes) {
 		const auto& n = nodes.find(id);
 		if (n == nodes.end()) {
 			warnln << "Internal error" << ' ' << __FILE__ << ':' << __LINE__;
 			continue;
 		}
-		const vector<size_t>& src = n->second.matrix_row;
-		for (size_t i = 0; i < size; i++)
-			min_nums[i] = min(min_nums[i], src[i]);
+		row_min(min_nums.data(), n->second.matrix_row.data(), size);
 	}
 	map<UUID, size_t> id_n;
 	size_t i = 0;
@@ -1244,11 +2252,11 @@ vector<const Msg*> Core::commands_to_write(const set<UUID>& dest_nodes) const
 
 void Core::after_write(OCCstream& f, const Msg& cmd) const
 {
-	if (cmd.value["name"] != "addfile")
+	if (cmd.name != "addfile")
 		return;
-	const Json::Value& jfrom = cmd.value["from"];
-	const Json::Value& jto = cmd.value["to"];
-	string fn = cfg.filesdir() + '/' + cmd.value["filename"].asString();
+	const Json::Value& jfrom = cmd.value()["from"];
+	const Json::Value& jto = cmd.value()["to"];
+	string fn = cfg.filesdir() + '/' + cmd.value()["filename"].asString();
 	if (jfrom.isInt64() && jto.isInt64()) {
 		size_t from = jfrom.asInt64();
 		size_t to = jto.asInt64();
@@ -1260,11 +2268,11 @@ void Core::after_write(OCCstream& f, const Msg& cmd) const
 
 void Core::after_read(ICCstream& f, const Msg& cmd)
 {
-	if (cmd.value["name"] != "addfile")
+	if (cmd.name != "addfile")
 		return;
-	const Json::Value& jfrom = cmd.value["from"];
-	const Json::Value& jto = cmd.value["to"];
-	string fn = cfg.filesdir() + '/' + cmd.value["filename"].asString();
+	const Json::Value& jfrom = cmd.value()["from"];
+	const Json::Value& jto = cmd.value()["to"];
+	string fn = cfg.filesdir() + '/' + cmd.value()["filename"].asString();
 	fs::path dir(fn);
 	dir.remove_filename();
 	fs::create_directories(dir);
@@ -1293,25 +2301,38 @@ void Core::write_packet(const string& filename) const
 {
 	switch(max_proto_ver()) {
 	case 1:
-		write_packet_v1(filename);
+	case 2: // differs in TCP sessions only
+		write_packet(filename, 1);
+		break;
+	case 3:
+	case 4:
+	case 5:
+	case 6:
+	case 7:
+		write_packet(filename, 2);
 		break;
 	default:
 		throw exc_error("Unsupported protocol version");
 	}
 }
 
-void Core::write_packet_v1(const string& filename) const
+// Version 2 differs by matrix format only
+void Core::write_packet(const string& filename, short pv) const
 {
 	Fstream f1 = Fstream::create(filename);
 	Ostream f2(f1);
 	OCCstream f3(f2, crypt_key);
-	f3.write(&protocol_version, sizeof(protocol_version));
-	nodes.write(f3);
+	f3.write(&pv, sizeof(pv));
+	if (pv >= 2)
+		nodes.write_compact(f3);
+	else
+		nodes.write(f3);
 	for (const Msg& m : messages) {
 		if (cfg.chk_free_space && !has_free_space(f1.fd, m.total_size()))
 			break;
-		f3.write_json(m.as_json());
+		f3.write_string(m.encoded());
 		after_write(f3, m);
+		m.unload();
 	}
 	f3.write_json(Json::Value());
 }
@@ -1325,16 +2346,17 @@ void Core::read_packet(const string& filename)
 	f3.read(&pv, sizeof(pv));
 	switch(pv) {
 	case 1:
-		read_packet_v1(f3);
+	case 2:
+		read_packet(f3, pv);
 		break;
 	default:
 		throw exc_error(_("Bad protocol version"));
 	}
 }
 
-void Core::read_packet_v1(ICCstream& f3)
+void Core::read_packet(ICCstream& f3, short pv)
 {
-	Matrix mtx = Matrix::read(f3);
+	Matrix mtx = pv >= 2 ? Matrix::read_compact(f3) : Matrix::read(f3);
 	if (status == NodeStatus::part_init) {
 		auto r = mtx.find(my_id);
 		if (r == mtx.end())
@@ -1362,13 +2384,24 @@ void Core::add_cmd(Msg&& cmd)
 		warnln << _("Bad command found");
 		return;
 	}
+	// Commands below known ones are already collected, do not store them again
+	const size_t known = my_node ? my_node->matrix_row[x] : 0;
+	if (cmd.msg_number < known || cmd.msg_number < messages.first(id))
+		return;
+	if (my_node && cmd.msg_number - known > max_cmd_gap) {
+		warnln << _("Bad command found");
+		return;
+	}
+	if (!messages.contains(cmd))
+		journal_add(cmd);
 	messages.insert(move(cmd));
 	need_save = true;
 	if (!my_node)
 		return;
 	size_t& c = my_node->matrix_row[x];
-	while(messages.find(Msg(id, c)) != messages.end())
+	while(messages.contains(MsgId(id, c)))
 		c++;
+	nodes.touch(my_id);
 }
 
 short Core::max_proto_ver() const
@@ -1466,12 +2499,32 @@ bool Core::check_msg_cnt(const UUID& id, size_t netmsgcnt)
 
 }
 
+size_t Core::next_netmsgcnt()
+{
+	if (!my_node)
+		return 0;
+	size_t res = my_node->netmsgcnt++;
+	// Reserve next block before current one is used up, save it with other changes
+	if (my_node->netmsgcnt + netmsgcnt_block / 2 > netmsgcnt_reserved) {
+		netmsgcnt_reserved = my_node->netmsgcnt + netmsgcnt_block;
+		need_save = true;
+	}
+	return res;
+}
+
 const Msg * Core::find_command(const MsgId& id) const
 {
-	auto p = messages.find(Msg(id));
-	if (p == messages.end())
-		return nullptr;
-	return &*p;
+	return messages.find(id);
+}
+
+Msg Core::load_command(const MsgId& id) const
+{
+	const Msg * m = find_command(id);
+	if (m == nullptr)
+		throw exc_error("Requested command not found");
+	Msg res = *m;
+	res.body(); // read from message log while locked
+	return res;
 }
 
 void Core::delnoderecord(const UUID& id)
@@ -1479,9 +2532,9 @@ void Core::delnoderecord(const UUID& id)
 	nodes.del(id);
 }
 
-void Core::write_net_initializer(ICCstream& sin, OCCstream& sout)
+void Core::write_net_initializer(ICCstream& sin, OCCstream& sout, short proto_ver)
 {
-	write_initializer_v1(sout);
+	write_initializer(sout, initializer_version(proto_ver));
 	sout.flush_net();
 	char ok;
 	UUID new_id;
@@ -1529,11 +2582,9 @@ void Core::update_hostname()
 	const string new_hostname = buf;
 	if (old_hostname == new_hostname)
 		return;
-	Json::Value cmd;
-	cmd["name"] = "sethostname";
-	cmd["val"] = new_hostname;
 	state_nodes[string(my_id)]["hostname"] = new_hostname;
-	create_command(move(cmd), false);
+	changed_nodes.insert(my_id);
+	create_command(HostnameCmd{new_hostname});
 }
 
 void Core::update_online()
@@ -1544,11 +2595,9 @@ void Core::update_online()
 	string online = asString(state_nodes[string(my_id)], "online");
 	if (online == dt)
 		return;
-	Json::Value cmd;
-	cmd["name"] = "online";
-	cmd["val"] = dt;
 	state_nodes[string(my_id)]["online"] = dt;
-	create_command(move(cmd), false);
+	changed_nodes.insert(my_id);
+	create_command(OnlineCmd{dt});
 }
 
 /* Return string with:
@@ -1605,13 +2654,10 @@ void Core::update_antivirus()
 	Json::Value& rec = state_nodes[string(my_id)]["antivirus"];
 	if (rec["updated"] == updated && rec["scanned"] == scanned && rec["found"] == found)
 		return;
-	Json::Value cmd;
-	cmd["name"] = "antivirus";
-	cmd["updated"] = updated;
-	cmd["scanned"] = scanned;
-	cmd["found"] = found;
-	state_nodes[s_my_id]["antivirus"] = cmd;
-	create_command(move(cmd), false);
+	AntivirusCmd cmd{updated, scanned, found};
+	state_nodes[s_my_id]["antivirus"] = state_cmd_json(cmd);
+	changed_nodes.insert(my_id);
+	create_command(move(cmd));
 }
 
 void Core::update_smart()
@@ -1634,19 +2680,13 @@ void Core::update_smart()
 		Json::Value& rec = state_nodes[string(my_id)]["smart"];
 		if (rec == false)
 			return;
-		Json::Value cmd;
-		cmd["name"] = "smart";
-		cmd["status"] = false;
-		create_command(move(cmd), false);
+		create_command(SmartCmd{false});
 		return;
 	}
 	Json::Value& rec = state_nodes[string(my_id)]["smart"];
 	if (rec == true)
 		return;
-	Json::Value cmd;
-	cmd["name"] = "smart";
-	cmd["status"] = true;
-	create_command(move(cmd), false);
+	create_command(SmartCmd{true});
 }
 
 void Core::pending_commands()
@@ -1694,6 +2734,11 @@ void Core::update_matrix(const Matrix& m)
 	need_save |= nodes.update(m);
 }
 
+void Core::update_matrix(const MatrixDelta& m)
+{
+	need_save |= nodes.update(m);
+}
+
 void Core::cwd() const
 {
 	string newdir = cfg.filesdir();
@@ -1715,34 +2760,29 @@ bool Core::node_alive(const UUID& id) const
 	return true;
 }
 
-void Core::exec_smart(const Msg& cmd)
-{
-	state_nodes[string(cmd.node_id)]["smart"] = move(cmd.value["status"]);
-}
-
 void Core::check_matrix()
 {
 	if (!my_node)
 		return;
 	vector<size_t> minrow = my_node->matrix_row;
-	for (auto& node : nodes) {
-		for (size_t i = 0; i < minrow.size(); i++)
-			minrow[i] = min(minrow[i], node.second.matrix_row[i]);
-	}
+	for (auto& node : nodes)
+		row_min(minrow.data(), node.second.matrix_row.data(), minrow.size());
 	size_t i = -1UL;
 	for (auto& node : nodes) {
 		i++;
 		for (size_t j = node.second.command_to_exec; j < my_node->matrix_row[i]; j++) {
-			if (messages.find(Msg(node.first, j)) != messages.end())
+			if (messages.contains(MsgId(node.first, j)))
 				continue;
 			if (j >= minrow[i] && my_node != &node.second) {
 				my_node->matrix_row[i] = j;
+				nodes.touch(my_id);
 				break;
 			}
 			Json::Value json;
 			json["name"] = "BAD MESSAGE";
 			Msg cmd(node.first, j);
-			cmd.value = move(json);
+			cmd.set_value(move(json));
+			journal_add(cmd);
 			messages.insert(move(cmd));
 			need_save = true;
 		}
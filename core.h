@@ -1,12 +1,23 @@
 #pragma once
 #include <map>
+#include <array>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <optional>
+#include <unordered_map>
 #include <set>
 #include <string>
 #include <mutex>
+#include <functional>
 #include "sha.h"
 #include "config.h"
 #include "ccstream.h"
 #include "usernames.h"
+#include "journal.h"
+#include "msglog.h"
+#include "spool.h"
+#include "statecmd.h"
 
 enum class NodeStatus : char {
 	/* Does not do anything, only try to initialize from someone
@@ -55,24 +66,75 @@ struct Msg : MsgId {
 	Json::Value as_json() const;
 	size_t total_size() const; // Total size required to store command on disk (approximately)
 	bool valid() const;
-
-	Json::Value value;
+	// Value and dependencies to store in message log. Kept until unload()
+	const std::string& body() const;
+	/* Compact json of as_json() to send to other nodes or write to packet.
+	 * Made from body() without building json */
+	std::string encoded() const;
+
+	/* Command itself. If it is not in memory, it is read from message log
+	 * and kept untill unload() */
+	const Json::Value& value() const;
+	void set_value(Json::Value&&);
+	void set_state(StateCmd&&); // set value of state command
+
+	// Typed record of state command. Made from value() on first call
+	const StateCmd& state() const;
+	void set_name(std::string&&); // also sets state_id
+
+	// Free memory used by value if it is stored in message log
+	void unload() const;
+
+	std::string name; // value()["name"], always in memory
+	StateCmdId state_id = StateCmdId::none; // by name
 	std::map<UUID, size_t> depends; // Commands to be executed before this one
-	mutable bool delete_flag = false;
+	mutable MsgLocation loc; // Place in message log
+
+	static const MsgLog * storage; // Message log to load values from
+private:
+	mutable Json::Value val;
+	mutable bool loaded = true;
+	mutable std::string body_str; // empty if not made yet
+	mutable std::shared_ptr<const StateCmd> state_rec;
+};
+
+struct MatrixDelta;
+
+/* Row of Matrix. Points to storage of matrix, so it is valid until nodes
+ * are added to or deleted from matrix */
+struct MatrixRow {
+	typedef size_t value_type;
+
+	size_t * data() { return p; }
+	const size_t * data() const { return p; }
+	size_t size() const { return n; }
+	size_t * begin() { return p; }
+	size_t * end() { return p + n; }
+	const size_t * begin() const { return p; }
+	const size_t * end() const { return p + n; }
+	size_t& operator[](size_t i) { return p[i]; }
+	const size_t& operator[](size_t i) const { return p[i]; }
+	bool operator==(const MatrixRow&) const;
+	operator std::vector<size_t>() const { return std::vector<size_t>(p, p + n); }
+private:
+	friend struct Matrix;
+	size_t * p = nullptr;
+	size_t n = 0;
 };
 
 struct Node {
 	enum class Intersting : char {
 		unknown,
 		yes,
-		no
+		no,
+		matrix // only matrix differs
 	};
 
 	Node() = default;
-	Node(const Json::Value&);
+	Node(const Json::Value&); // row is loaded by Matrix::load_nodes()
 
 	// Update parameter with values from this node. Used in save()
-	void update(Json::Value&) const;
+	void update(Json::Value&, bool with_row = true) const;
 
 	/* Commands of other nodes that are known to this node.
 	 * Each node numerates it's commands sequentially.
@@ -82,7 +144,7 @@ struct Node {
 	 * For example, matrix_row[2] = 7 means that this node knows all commands
 	 * from node nodes.begin()+2 (MsgId::node_id == nodes.begin()+2)
 	 * with numbers 0..6 (MsgId::cmd_number == 6). */
-	std::vector<size_t> matrix_row;
+	MatrixRow matrix_row;
 
 	// Node state, hash of it's matrix
 	SHA256 hash;
@@ -101,8 +163,102 @@ struct Node {
 
 	bool initialized = true;
 	Intersting interesting = Intersting::no;
+
+	// Root of Merkle tree over row, got from node itself, see RowTree
+	SHA256 row_hash {};
+};
+
+/* All commands known to node grouped by author. Commands of each author are
+ * kept in deque indexed by number minus number of first kept command (numbers
+ * are dense) and removed from the beginning only, when they are executed and
+ * known to all nodes (see Core::remove_old_commands()). Authors are found by
+ * hash and iterated in order of UUIDs, so iteration is in order of MsgId.
+ * Pointers to commands stay valid until commands are removed */
+struct MsgStore {
+	struct AuthorMsgs {
+		UUID id;
+		size_t base = 0; // number of first element
+		std::deque<std::optional<Msg>> msgs; // first and last are not empty
+	};
+	typedef std::vector<AuthorMsgs *> Authors;
+
+	MsgStore() = default;
+	MsgStore(const MsgStore&);
+	MsgStore(MsgStore&&) = default;
+	MsgStore& operator=(const MsgStore&);
+	MsgStore& operator=(MsgStore&&) = default;
+
+	struct const_iterator {
+		const_iterator(Authors::const_iterator, Authors::const_iterator end);
+		const Msg& operator*() const;
+		const Msg * operator->() const;
+		const_iterator& operator++();
+		bool operator==(const const_iterator&) const;
+	private:
+		void skip_empty();
+		Authors::const_iterator a, a_end;
+		size_t i = 0;
+	};
+
+	const_iterator begin() const;
+	const_iterator end() const;
+	size_t size() const;
+	bool empty() const;
+	void clear();
+
+	// Return nullptr if command is not found
+	const Msg * find(const MsgId&) const;
+	bool contains(const MsgId&) const;
+
+	// Number of first kept command of author, 0 if there are no commands
+	size_t first(const UUID& author) const;
+
+	// Insert command if it is absent. Return stored command and true if inserted
+	std::pair<const Msg *, bool> insert(Msg&&);
+	void erase(const MsgId&);
+
+	/* Remove commands of author with numbers less than specified.
+	 * Function is called for each command before removal and may add commands */
+	void truncate(const UUID& author, size_t number, const std::function<void(const Msg&)>&);
+
+	std::vector<UUID> authors() const;
+
+	// Is node target of 'delnode' command with force flag
+	bool force_deleted(const UUID&) const;
+private:
+	void count_force(const Msg&, int);
+	AuthorMsgs& author(const UUID&);
+	void remove_author(const UUID&);
+	// Drop empty elements at ends, remove author if nothing left
+	void trim(AuthorMsgs&);
+
+	std::unordered_map<UUID, AuthorMsgs> index;
+	Authors order; // sorted by UUID
+	size_t count = 0;
+	std::map<UUID, size_t> force_del; // target node -> number of commands
 };
 
+// Node state prepared to write to disk. See Core::prepare_save()
+struct SaveJob {
+	bool checkpoint = false;
+	size_t generation = 0; // of new node file
+	std::string data; // contents of new node file
+	Json::Value record; // journal record
+	std::vector<MsgLog::Write> bodies; // command bodies to append to message log
+	std::vector<MsgId> stored; // commands placed to message log
+};
+
+// Result of program run by 'exec' command. See Core::exec_parallel()
+struct ExecOutput {
+	bool run = false;
+	bool ok = false;
+	bool cancelled = false; // program is killed because daemon stopped
+	std::string cmd;
+	Spool output;
+};
+
+struct ExecQueue;
+
 struct GroupIdPacket {
 	UUID group_id;
 	CryptKey key;
@@ -117,20 +273,34 @@ struct TrailerUUIDs {
  * sequential numbers, as host node knows). Each row describe node (what
  * commands it knows). Each column describe source (author) node. So if i-row
  * and j-column contains value x this means that this host knows that i-node
- * knows all commands from j-node till x exclusively */
+ * knows all commands from j-node till x exclusively.
+ * Cells are kept in one contiguous buffer, rows of nodes point to it */
 struct Matrix : std::map<UUID, Node> {
+	Matrix() = default;
+	Matrix(const Matrix&);
+	Matrix(Matrix&&);
+	Matrix& operator=(const Matrix&);
+	Matrix& operator=(Matrix&&);
+
 	// Get row for specified node
 	Node& operator[](const UUID&);
 
 	// Create new matrix 1x1
 	void create(const UUID&);
 
+	// Make matrix of specified nodes with zero cells
+	void init(const std::vector<UUID>&);
+	void clear();
+
 	// Read matrix from parameter source
 	static Matrix read(ICCstream&);
 
 	// Read matrix with some additional data. Used in node initialization
 	static Matrix read_vld(ICCstream&);
 
+	// Read matrix written by write_compact()
+	static Matrix read_compact(ICCstream&, bool vld = false);
+
 	// Load from json source. Used in load() at program startup
 	static Matrix load_nodes(const Json::Value&);
 
@@ -140,10 +310,15 @@ struct Matrix : std::map<UUID, Node> {
 	// Write matrix with some additional data. Used in node initialization
 	void write_vld(OCCstream&) const;
 
+	/* Write matrix with varints, each row as difference with previous one.
+	 * If vld is set additional data is written too, see write_vld() */
+	void write_compact(OCCstream&, bool vld = false) const;
+
 	/* Update rows from src, new values is max(old-val, src-val)
 	 * Nodes not presented in src keep their values
 	 * Unknown nodes in source are ignored */
 	bool update(const Matrix& src);
+	bool update(const MatrixDelta& src);
 
 	// Add new nodes to matrix, they are copy of 'from_node'
 	void resize(const UUID& new_ids, const Node* from_node, short proto_ver);
@@ -155,8 +330,38 @@ struct Matrix : std::map<UUID, Node> {
 	/* Get offset of record with specified node from begin. Used to read column
 	 * by it's node identifier */
 	ssize_t node_offset(const UUID& id) const;
+
+	/* Hash of matrix. Hashes of rows (with UUIDs of nodes) are summed, so
+	 * only rows changed since previous call are hashed. Rows changed outside
+	 * of Matrix should be marked by touch() */
+	SHA256 hash() const;
+	void touch(const UUID&);
+
+	// Changed each time nodes are added or deleted
+	size_t layout() const { return layout_cnt; }
+
+	/* Flags of rows (by offset) touched since previous call. Used to
+	 * journal changed rows only */
+	std::vector<char> take_changed();
 private:
 	void write(OCCstream&, size_t) const;
+	// Point rows of nodes to cells and rebuild index
+	void rebind();
+	void touch(size_t offset);
+
+	// All rows one by one, N x N in order of nodes
+	std::vector<size_t> cells;
+	std::unordered_map<UUID, size_t> index; // node -> offset
+	std::vector<const UUID *> ids; // offset -> node
+
+	typedef std::array<uint64_t, 4> RowHash; // SHA256 as numbers to be summed
+	mutable std::vector<RowHash> row_hashes;
+	mutable RowHash hash_sum;
+	mutable std::vector<size_t> touched; // offsets of rows to be hashed
+	mutable std::vector<char> is_touched;
+	mutable bool hash_valid = false; // false - all rows should be hashed
+	size_t layout_cnt = 0;
+	std::vector<char> changed; // rows touched since take_changed()
 };
 
 // Core base contains common read-only info and is public for all inherited classes
@@ -202,6 +407,14 @@ struct Core : virtual CoreBase {
 	// Save state. In case of errors print them to stderr and exit program
 	void save(bool force = false);
 
+	/* Save in three steps so that files are written without lock:
+	 * prepare_save() takes changes to save, return false if nothing to save;
+	 * write_save() writes them to disk and uses only job and journal;
+	 * finish_save() cleans up, return true if save() was called meanwhile */
+	bool prepare_save(SaveJob&, bool force);
+	void write_save(SaveJob&);
+	bool finish_save(const SaveJob&, bool ok);
+
 	// Create new group and initialize this node. Return true if created
 	bool create_group();
 
@@ -289,6 +502,8 @@ struct Core : virtual CoreBase {
 	void incm_delnode(std::ostream&, std::vector<std::string>&);
 	void incm_listnodes(std::ostream&, std::vector<std::string>&);
 	void incm_addfile(std::ostream&, std::vector<std::string>&);
+	// Create 'addfile' commands for file (name is relative to files directory)
+	void add_file(const std::string& rel_fn);
 	void incm_delfile(std::ostream&, std::vector<std::string>&);
 	void incm_deldir(std::ostream&, std::vector<std::string>&);
 	void incm_listonline(std::ostream&, std::vector<std::string>&);
@@ -312,25 +527,40 @@ struct Core : virtual CoreBase {
 	void incm_queue(std::ostream&, std::vector<std::string>&);
 	void incm_nodesinfo(std::ostream&, std::vector<std::string>&);
 	void incm_stored_commands(std::ostream&, std::vector<std::string>&);
+	void incm_export_state(std::ostream&, std::vector<std::string>&);
 
 	/* Commands means commands that are distribued between nodes and executed
 	 * as soon as they are become known to node
 	 * These functions are implemented in commands.cpp */
 	void exec(const Msg&);
 	void exec_addnode(const Msg&);
-	void exec_sethostname(const Msg&);
 	void exec_delnode(const Msg&);
 	void exec_delnoderecord(const Msg&);
-	void exec_online(const Msg&);
 	void exec_addfile(const Msg&);
 	void exec_exec(const Msg&);
 	void exec_executed(const Msg&);
 	void exec_delexec(const Msg&);
 	void exec_dellog(const Msg&);
-	void exec_antivirus(const Msg&);
 	void exec_adduser(const Msg&);
 	void exec_deluser(const Msg&);
-	void exec_smart(const Msg&);
+	// 'online', 'antivirus', 'smart' and 'sethostname'
+	void exec_state(const Msg&);
+
+	/* Run programs of several 'exec' commands at once, using not more than
+	 * exec-threads threads. Result for other commands (or if there is only
+	 * one 'exec') is not run, such commands are executed by exec() */
+	std::vector<ExecOutput> exec_parallel(const std::vector<const Msg *>&) const;
+	/* Finish 'exec' command run by exec_parallel(). Output larger than
+	 * exec-preview-size is distributed as file, see exec_output_file() */
+	void exec_output(const MsgId&, const ExecOutput&);
+
+	/* Start program of 'exec' command without waiting for it.
+	 * Return false if program should be run now */
+	virtual bool exec_start(const MsgId&, const std::string& cmdline);
+	// Start program of command if it is 'exec' and it can be run in background
+	bool exec_background(const Msg&);
+	// Finish command started by exec_background()
+	void exec_done(const MsgId&, const ExecOutput&);
 
 	/* These functions executed before delete command
 	 * Command deleted from node when it is executed and known to all other nodes
@@ -351,25 +581,34 @@ protected:
 	// Update and return true if msgcnt is newer than known of node with uuid specified
 	bool check_msg_cnt(const UUID&, size_t msgcnt);
 
+	/* Return next value of this node net messages counter. Values are given
+	 * from memory, only reserved mark is saved (see netmsgcnt_reserved) */
+	size_t next_netmsgcnt();
+
 	SHA256 calc_my_hash() const;
 
 	const Msg * find_command(const MsgId& id) const;
 
+	// Return copy of command with value loaded from message log
+	Msg load_command(const MsgId& id) const;
+
 	// Remove commands that are no more need to keep (i.e. known to all nodes)
 	void remove_old_commands();
 
 	virtual void delnoderecord(const UUID&);
 	void read_net_initializer(ICCstream&, OCCstream&, const UUID& remote_id);
-	void write_net_initializer(ICCstream&, OCCstream&);
+	void write_net_initializer(ICCstream&, OCCstream&, short proto_ver);
 
 	void update_node_hash(const UUID&, const SHA256&);
 
 	void update_matrix(const Matrix&);
+	void update_matrix(const MatrixDelta&);
 
 	void pending_commands();
 
 	// Create new command entered by user into json. Store new command in 'commands'
 	void create_command(Json::Value&&, bool add_depends = true);
+	void create_command(StateCmd&&);
 
 	// Create command to tell hostname, online and antivirus
 	void update_info();
@@ -393,36 +632,82 @@ protected:
 	Node* my_node = nullptr;
 
 private:
-	UUID read_initializer_v1(ICCstream&);
-	void write_initializer_v1(OCCstream&);
+	// Number command with next number of this node and store it
+	void create_command(Msg&&, bool add_depends);
+
+	// Data to initialize new node. Return id of node which wrote it
+	UUID read_initializer(ICCstream&);
+	void write_initializer(OCCstream&, short version);
 
 	// Reads from data exchanged by nodes
-	static std::set<Msg> read_messages(ICCstream&);
+	static MsgStore read_messages(ICCstream&);
 	TrailerUUIDs read_trailer_uuids(Istream&, size_t) const;
 	GroupIdPacket read_group_id(Istream&, const std::string& passwd);
 	void read_online_invite(const std::string& filename, const std::string& passwd);
 	void read_offline_invite(const std::string& filename, const std::string& passwd);
-	void read_packet_v1(ICCstream& f3);
+	void read_packet(ICCstream& f3, short version);
 
 	// Writes data to exchange by nodes
-	void write_packet_v1(const std::string& filename) const;
+	void write_packet(const std::string& filename, short version) const;
 	void write_messages(OCCstream&) const;
 	void write_trailer_uuids(Ostream&, const TrailerUUIDs&) const;
 
 	// Load group id from file. Return true if new group was created
 	bool load_group_id();
 
+	// Load journal and apply it's records to state loaded from node file
+	void load_journal();
+	void load_journal_record(const Json::Value&);
+
 	static NodeStatus load_status(const Json::Value&);
-	static std::set<Msg> load_messages(const Json::Value&);
+	static MsgStore load_messages(const Json::Value&);
 	static std::set<std::string> load_filenames(const Json::Value&);
-	Json::Value load_local_state();
-	Json::Value load_local_state(const std::string&);
+	void load_local_state();
+	void load_local_state(const std::string&);
+
+	// Load state from binary node file
+	void load_checkpoint(const std::string&);
+
+	// Load state from json (old node file format or export-state output)
+	void import_state(const Json::Value&);
 
 	// Save group id to file (without any encryption)
 	void save_group_id(const std::string& filename) const;
 
-	// Return pointer to 'state_nodes' with updated info about nodes
-	Json::Value& save_nodes();
+	// Prepare full state to write to node file and start new journal
+	void prepare_checkpoint(SaveJob&);
+
+	// Return full state as json. Used by export-state command
+	Json::Value export_state();
+
+	// Prepare changes made after last save to append to journal
+	void prepare_journal(SaveJob&);
+
+	// Remember added/deleted command to write it to journal on next save
+	void journal_add(const MsgId&);
+	void journal_del(const Msg&);
+
+	// Place bodies of added commands to message log, return their ids
+	std::vector<MsgId> flush_messages();
+
+	// Count loaded commands in message log segments
+	void ref_messages();
+
+	// Delete all commands. Used when whole state is replaced
+	void clear_messages();
+
+	// Forget changes written to journal or node file
+	void clear_changes();
+
+	/* Return info about nodes with values from 'nodes'. Deleted nodes are
+	 * removed from 'state_nodes' */
+	Json::Value save_nodes();
+
+	// Return nodes changed since last save, only changed cells of rows
+	Json::Value save_nodes_changes();
+
+	// Remember nodes as written to journal or node file
+	void snapshot_nodes();
 
 	// Return json array with commands
 	Json::Value save_commands() const;
@@ -433,9 +718,6 @@ private:
 	// Return text representation of this node status
 	const std::string& status_string() const;
 
-	// Return next command to exec or nullptr
-	const Msg * command_to_exec() const;
-
 	// Mark command as executed
 	void mark_as_executed(const Msg&);
 
@@ -452,6 +734,9 @@ private:
 	 * false if nothisg was executed */
 	bool execute_pending_commands();
 
+	// Add nodes of executed addnode commands to matrix by one resize
+	void add_new_nodes();
+
 	// Create command to tell everyone hostname of this node if it is changed
 	void update_hostname();
 
@@ -470,7 +755,7 @@ private:
 	Json::Value state;
 	std::set<std::string> filenames;
 	Usernames users;
-	std::set<Msg> messages;
+	MsgStore messages;
 
 	// id for off-line initialization file
 	UUID invite_id;
@@ -479,8 +764,59 @@ private:
 
 	bool valid_node = false;
 
+	// Nodes of addnode commands, not added to matrix yet
+	std::vector<UUID> new_nodes;
+
 	bool need_save = false;
 
+	// Bodies of commands
+	MsgLog msglog;
+
+	// Changes after last save. Used to write journal
+	Journal journal;
+	std::set<MsgId> added_msgs;
+	std::set<MsgId> deleted_msgs;
+	size_t saved_exec = 0; // Count of records in state["exec"] already saved
+	bool need_checkpoint = false; // Whole state is replaced
+	bool state_changed = false; // 'state' is changed not only by appending to state["exec"]
+	bool users_changed = false;
+	bool filenames_changed = false;
+	std::set<UUID> changed_nodes; // info in 'state_nodes' is changed
+	Matrix saved_nodes; // nodes as written last time, see snapshot_nodes()
+	size_t saved_layout = 0; // nodes.layout() when they were written
+
+	// Generation of last written node file. Journal belongs to it
+	size_t generation = 0;
+
+	// Size of last written node file
+	size_t checkpoint_size = 0;
+
+	/* Counter of net messages of this node is saved as mark reserved ahead
+	 * by blocks, so it is not saved on each message. Node continues from
+	 * this mark after restart */
+	size_t netmsgcnt_reserved = 0;
+	const size_t netmsgcnt_block = 1024;
+
+	// Queue of commands while execute_pending_commands() is running
+	ExecQueue * exec_queue = nullptr;
+
+	// Commands with programs running in background, see exec_background()
+	std::set<MsgId> exec_running;
+
+	bool saving = false; // Between prepare_save() and finish_save()
+	bool save_deferred = false; // save() called while saving
+
+	/* Journal is compacted into node file when it becomes bigger than node file
+	 * and this size */
+	const size_t journal_min_size = 0x100000;
+
+	/* Commands numbered further than this ahead of known ones are rejected,
+	 * they would make store of author grow by the whole gap */
+	const size_t max_cmd_gap = 0x10000;
+
+	// Directory in files directory for output of 'exec' commands
+	static constexpr const char * exec_output_dir = "exec-output";
+
 	// Count of iterations to hash password to create key to crypt invite file
 	const unsigned pbkdf2_iter_count = 200;
 };
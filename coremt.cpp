@@ -27,6 +27,29 @@ void CoreMT::save(bool force)
 	Core::save(force);
 }
 
+bool CoreMT::prepare_save(SaveJob& job, bool force)
+{
+	lock lck(mtx);
+	return Core::prepare_save(job, force);
+}
+
+void CoreMT::write_save(SaveJob& job)
+{
+	Core::write_save(job);
+}
+
+bool CoreMT::finish_save(const SaveJob& job, bool ok)
+{
+	lock lck(mtx);
+	return Core::finish_save(job, ok);
+}
+
+void CoreMT::exec_done(const MsgId& id, const ExecOutput& res)
+{
+	lock lck(mtx);
+	Core::exec_done(id, res);
+}
+
 void CoreMT::pending_commands()
 {
 	lock lck(mtx);
@@ -51,10 +74,10 @@ in6_addr CoreMT::ipv6_group() const
 	return CoreNet::ipv6_group();
 }
 
-IN6ad CoreMT::addr_to_connect(bool server_busy, const UUID& conn_id)
+IN6ad CoreMT::addr_to_connect(const std::set<UUID>& busy, UUID& node_id)
 {
 	lock lck(mtx);
-	return CoreNet::addr_to_connect(server_busy, conn_id);
+	return CoreNet::addr_to_connect(busy, node_id);
 }
 
 bool CoreMT::check_msg_cnt(const UUID& id, size_t cnt)
@@ -63,10 +86,10 @@ bool CoreMT::check_msg_cnt(const UUID& id, size_t cnt)
 	return Core::check_msg_cnt(id, cnt);
 }
 
-void CoreMT::add_node(const UUID& id, const IN6ad& ad, const SHA256& hash, bool initialized)
+void CoreMT::add_node(const UUID& id, const IN6ad& ad, const SHA256& hash, const SHA256& row_hash, bool initialized)
 {
 	lock lck(mtx);
-	return CoreNet::add_node(id, ad, hash, initialized);
+	return CoreNet::add_node(id, ad, hash, row_hash, initialized);
 }
 
 void CoreMT::del_addr(const IN6ad& ad)
@@ -75,7 +98,7 @@ void CoreMT::del_addr(const IN6ad& ad)
 	return CoreNet::del_addr(ad);
 }
 
-TCPHeloMsg CoreMT::get_tcp_helo() const
+TCPHeloMsg CoreMT::get_tcp_helo()
 {
 	lock lck(mtx);
 	return CoreNet::get_tcp_helo();
@@ -87,10 +110,10 @@ void CoreMT::read_net_initializer(ICCstream& fin, OCCstream& fout, const UUID& r
 	CoreNet::read_net_initializer(fin, fout, remote_id);
 }
 
-void CoreMT::write_net_initializer(ICCstream& fin, OCCstream& fout)
+void CoreMT::write_net_initializer(ICCstream& fin, OCCstream& fout, short proto_ver)
 {
 	lock lck(mtx);
-	CoreNet::write_net_initializer(fin, fout);
+	CoreNet::write_net_initializer(fin, fout, proto_ver);
 }
 
 void CoreMT::update_matrix(const Matrix& m)
@@ -99,12 +122,36 @@ void CoreMT::update_matrix(const Matrix& m)
 	Core::update_matrix(m);
 }
 
-MsgRequest CoreMT::request_message_from_node(const UUID& remote_node) const
+string CoreMT::matrix_delta(uint64_t epoch, uint64_t version)
+{
+	lock lck(mtx);
+	return CoreNet::matrix_delta(epoch, version);
+}
+
+void CoreMT::matrix_base(const UUID& remote_node, uint64_t& epoch, uint64_t& version) const
+{
+	lock lck(mtx);
+	CoreNet::matrix_base(remote_node, epoch, version);
+}
+
+void CoreMT::update_matrix(const UUID& remote_node, const string& data)
+{
+	lock lck(mtx);
+	CoreNet::update_matrix(remote_node, data);
+}
+
+MsgRequest CoreMT::request_message_from_node(const UUID& remote_node)
 {
 	lock lck(mtx);
 	return CoreNet::request_message_from_node(remote_node);
 }
 
+MsgRangeRequest CoreMT::request_messages_from_node(const UUID& remote_node, size_t limit)
+{
+	lock lck(mtx);
+	return CoreNet::request_messages_from_node(remote_node, limit);
+}
+
 void CoreMT::add_msg_request(const MsgId& cmd)
 {
 	lock lck(mtx);
@@ -117,6 +164,14 @@ void CoreMT::del_msg_request(const MsgId& cmd)
 	downloading_msgs.erase(cmd);
 }
 
+void CoreMT::del_msg_requests(const vector<MsgRange>& ranges)
+{
+	lock lck(mtx);
+	for (const MsgRange& r : ranges)
+		for (size_t k = r.first; k < r.last; k++)
+			downloading_msgs.erase(MsgId(r.node_id, k));
+}
+
 void CoreMT::after_read(ICCstream& f, const Msg& cmd)
 {
 	lock lck(mtx);
@@ -147,6 +202,12 @@ const Msg * CoreMT::find_command(const MsgId& id) const
 	return CoreNet::find_command(id);
 }
 
+Msg CoreMT::load_command(const MsgId& id) const
+{
+	lock lck(mtx);
+	return CoreNet::load_command(id);
+}
+
 void CoreMT::remove_old_commands()
 {
 	lock lck(mtx);
@@ -9,30 +9,40 @@ struct CoreMT : private CoreNet {
 
 	void load();
 	void save(bool force = false);
+	bool prepare_save(SaveJob&, bool force);
+	void write_save(SaveJob&); // Without lock, see Core::prepare_save()
+	bool finish_save(const SaveJob&, bool ok);
+	void exec_done(const MsgId&, const ExecOutput&);
 	void pending_commands();
 	void broadcast_helo();
 	void broadcast_bye();
 	in6_addr ipv6_group() const;
-	IN6ad addr_to_connect(bool server_busy, const UUID& conn_id);
+	IN6ad addr_to_connect(const std::set<UUID>& busy, UUID& node_id);
 	void read_net_initializer(ICCstream&, OCCstream&, const UUID& remote_id);
-	void write_net_initializer(ICCstream&, OCCstream&);
+	void write_net_initializer(ICCstream&, OCCstream&, short proto_ver);
 	void update_matrix(const Matrix&);
-	MsgRequest request_message_from_node(const UUID& remote_node) const;
+	std::string matrix_delta(uint64_t epoch, uint64_t version);
+	void matrix_base(const UUID& remote_node, uint64_t& epoch, uint64_t& version) const;
+	void update_matrix(const UUID& remote_node, const std::string&);
+	MsgRequest request_message_from_node(const UUID& remote_node);
+	MsgRangeRequest request_messages_from_node(const UUID& remote_node, size_t limit);
 	void add_msg_request(const MsgId&);
 	void del_msg_request(const MsgId&);
+	void del_msg_requests(const std::vector<MsgRange>&);
 	void after_read(ICCstream&, const Msg&);
 	void after_write(OCCstream&, const Msg&);
 	void add_cmd(Msg&& cmd);
 	void write_matrix(OCCstream&) const;
 	const Msg * find_command(const MsgId&) const;
+	Msg load_command(const MsgId&) const;
 	void update_my_hash();
 	bool interactive_exec(const std::string&, std::ostream&); // return false for disconnect
 protected:
 	bool check_msg_cnt(const UUID&, size_t);
-	void add_node(const UUID&, const IN6ad&, const SHA256& hash, bool initialized);
+	void add_node(const UUID&, const IN6ad&, const SHA256& hash, const SHA256& row_hash, bool initialized);
 	void update_node_hash(const UUID&, const SHA256&);
 	void del_addr(const IN6ad&);
-	TCPHeloMsg get_tcp_helo() const;
+	TCPHeloMsg get_tcp_helo();
 	void remove_old_commands();
 	void update_info();
 	bool node_known(const UUID&) const;
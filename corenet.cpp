@@ -12,6 +12,7 @@
 
 using std::cout;
 using std::endl;
+using std::set;
 using std::vector;
 using std::string;
 using std::ostringstream;
@@ -25,7 +26,7 @@ UDPcrypted CoreNet::broadcast_helo_v1()
 {
 	UDPcrypted buf;
 	buf.msg.v1.version = 1;
-	buf.msg.v1.counter = my_node ? my_node->netmsgcnt++ : 0;
+	buf.msg.v1.counter = next_netmsgcnt();
 	buf.msg.v1.group_id = group_id;
 	buf.msg.v1.node_id = my_id;
 	buf.msg.v1.node_hash = calc_my_hash();
@@ -34,6 +35,20 @@ UDPcrypted CoreNet::broadcast_helo_v1()
 	return buf;
 }
 
+UDPcrypted CoreNet::broadcast_helo_v2()
+{
+	UDPcrypted buf;
+	buf.msg.v2.version = 2;
+	buf.msg.v2.counter = next_netmsgcnt();
+	buf.msg.v2.group_id = group_id;
+	buf.msg.v2.node_id = my_id;
+	buf.msg.v2.node_hash = calc_my_hash();
+	buf.msg.v2.row_hash = calc_row_hash();
+	buf.msg.v2.message =
+		status == NodeStatus::uninitialized ? UDPmessage_v1::not_initialized : UDPmessage_v1::helo;
+	return buf;
+}
+
 in6_addr CoreNet::ipv6_group() const
 {
 	in6_addr res;
@@ -50,16 +65,24 @@ void CoreNet::broadcast_helo()
 	size_t size;
 	switch (max_proto_ver()) {
 	case 1:
+	case 2:
+	case 3:
+	case 4:
 		buf = broadcast_helo_v1();
 		size = sizeof(Nonce) + sizeof(UDPmessage_v1);
 		break;
+	case 5:
+	case 6:
+	case 7:
+		buf = broadcast_helo_v2();
+		size = sizeof(Nonce) + sizeof(UDPmessage_v2);
+		break;
 	default:
 		error(1, 0, _("Bad protocol version"));
 	}
 	buf.encrypt(crypt_key);
 	for (const IFName& addr : cfg.listen)
 		broadcast(addr.dev, buf, size);
-	save(true);
 }
 
 void CoreNet::broadcast_bye()
@@ -69,17 +92,26 @@ void CoreNet::broadcast_bye()
 	size_t size;
 	switch (max_proto_ver()) {
 	case 1:
+	case 2:
+	case 3:
+	case 4:
 		buf = broadcast_helo_v1();
 		buf.msg.v1.message = UDPmessage_v1::Command::bye;
 		size = sizeof(Nonce) + sizeof(UDPmessage_v1);
 		break;
+	case 5:
+	case 6:
+	case 7:
+		buf = broadcast_helo_v2();
+		buf.msg.v2.message = UDPmessage_v1::Command::bye;
+		size = sizeof(Nonce) + sizeof(UDPmessage_v2);
+		break;
 	default:
 		error(1, 0, _("Bad protocol version"));
 	}
 	buf.encrypt(crypt_key);
 	for (const IFName& addr : cfg.listen)
 		broadcast(addr.dev, buf, size);
-	save(true);
 }
 
 void CoreNet::broadcast(const char * ifn, const UDPcrypted& buf, size_t size) const
@@ -111,6 +143,7 @@ void CoreNet::update_my_hash()
 		return;
 	SHA256 old_hash = my_node->hash;
 	SHA256 new_hash = calc_my_hash();
+	calc_row_hash();
 	if (old_hash != new_hash) {
 		debug << "My hash changed, " << new_hash.partial();
 		my_node->hash = new_hash;
@@ -124,12 +157,21 @@ void CoreNet::pending_commands()
 	update_my_hash();
 }
 
-void CoreNet::add_node(const UUID& id, const IN6ad& ad, const SHA256& hash, bool initialized)
+const SHA256& CoreNet::calc_row_hash()
+{
+	if (my_node)
+		my_row_hash = row_tree.update(nodes, *my_node);
+	return my_row_hash;
+}
+
+void CoreNet::add_node(const UUID& id, const IN6ad& ad, const SHA256& hash, const SHA256& row_hash, bool initialized)
 {
 	debug << "Add node";
 	auto p = nodes.find(id);
 	if (p != nodes.end()) {
 		p->second.hash = hash;
+		if (row_hash) // TCP helo has no row hash, keep one from UDP helo
+			p->second.row_hash = row_hash;
 		p->second.initialized = initialized;
 		ips[ad] = &p->second;
 	} else
@@ -149,12 +191,24 @@ bool CoreNet::need_communicate(const Node& n) const
 	return my_node && (n.matrix_row != my_node->matrix_row || (n.hash && n.hash != my_node->hash));
 }
 
-IN6ad CoreNet::addr_to_connect(bool server_busy, const UUID& conn_id)
+bool CoreNet::need_messages(const Node& n) const
+{
+	if (!my_node)
+		return false;
+	if (n.matrix_row != my_node->matrix_row)
+		return true;
+	// Nodes of protocol 4 and older send node hash only
+	return n.row_hash ? n.row_hash != my_row_hash : n.hash && n.hash != my_node->hash;
+}
+
+IN6ad CoreNet::addr_to_connect(const set<UUID>& busy, UUID& node_id)
 {
 	print_hashes();
+	node_id.clear();
 	vector<IN6ad> addrs;
+	vector<IN6ad> matrix_addrs;
 	for(auto& n : nodes) {
-		if (server_busy && n.first == conn_id)
+		if (busy.contains(n.first))
 			n.second.interesting = Node::Intersting::no;
 		else
 			n.second.interesting = Node::Intersting::unknown;
@@ -167,18 +221,32 @@ IN6ad CoreNet::addr_to_connect(bool server_busy, const UUID& conn_id)
 		if (n.second->interesting == Node::Intersting::unknown) {
 			if ((status == NodeStatus::uninitialized || status == NodeStatus::part_init) && !n.second->initialized)
 				n.second->interesting = Node::Intersting::no;
-			else if (need_communicate(*n.second))
+			else if (need_messages(*n.second))
 				n.second->interesting = Node::Intersting::yes;
+			else if (need_communicate(*n.second))
+				n.second->interesting = Node::Intersting::matrix;
 			else
 				n.second->interesting = Node::Intersting::no;
 		}
 		if (n.second->interesting == Node::Intersting::yes)
 			addrs.push_back(n.first);
+		else if (n.second->interesting == Node::Intersting::matrix)
+			matrix_addrs.push_back(n.first);
 	}
+	// Matrix is exchanged in every session, so nodes which differ only in it wait
+	if (addrs.empty())
+		addrs.swap(matrix_addrs);
 	if (addrs.empty())
 		return IN6ad::none();
 	uniform_int_distribution<size_t> dist(0, addrs.size() - 1);
-	return addrs[dist(rd)];
+	IN6ad ad = addrs[dist(rd)];
+	if (const Node * p = ips[ad])
+		for (const auto& n : nodes)
+			if (&n.second == p) {
+				node_id = n.first;
+				break;
+			}
+	return ad;
 
 	IN6ad res = addrs[dist(rd)];
 	debug << res.name();
@@ -194,18 +262,18 @@ IN6ad CoreNet::addr_to_connect(bool server_busy, const UUID& conn_id)
 	return res;
 }
 
-TCPHeloMsg CoreNet::get_tcp_helo() const
+TCPHeloMsg CoreNet::get_tcp_helo()
 {
 	TCPHeloMsg res;
 	res.node_id = my_id;
 	res.node_hash = my_node ? my_node->hash : SHA256();
-	res.msg_cnt = my_node ? my_node->netmsgcnt++ : 0;
+	res.msg_cnt = next_netmsgcnt();
 	res.version = max_proto_ver();
 	res.initialized = !need_initialize();
 	return res;
 }
 
-MsgRequest CoreNet::request_message_from_node(const UUID& remote_node) const
+MsgRequest CoreNet::request_message_from_node(const UUID& remote_node)
 {
 	MsgRequest res;
 	if (!my_node)
@@ -224,13 +292,75 @@ MsgRequest CoreNet::request_message_from_node(const UUID& remote_node) const
 				continue;
 			res.node_id = uuids[j];
 			res.msg_number = my_node->matrix_row[j];
+			downloading_msgs.insert(res);
 			break;
 		}
 	return res;
 }
 
+MsgRangeRequest CoreNet::request_messages_from_node(const UUID& remote_node, size_t limit)
+{
+	MsgRangeRequest res;
+	if (!my_node)
+		return res;
+	auto n = nodes.find(remote_node);
+	assert(n != nodes.end());
+	size_t cnt = 0;
+	size_t j = 0;
+	for (auto a = nodes.begin(); a != nodes.end() && cnt < limit; a++, j++)
+		for (size_t k = my_node->matrix_row[j]; k < n->second.matrix_row[j] && cnt < limit; k++) {
+			MsgId id(a->first, k);
+			if (find_command(id) || downloading_msgs.contains(id))
+				continue;
+			downloading_msgs.insert(id);
+			cnt++;
+			if (!res.ranges.empty() && res.ranges.back().node_id == a->first && res.ranges.back().last == k)
+				res.ranges.back().last++;
+			else
+				res.ranges.push_back({a->first, k, k + 1});
+		}
+	return res;
+}
+
+string CoreNet::matrix_delta(uint64_t epoch, uint64_t version)
+{
+	return matrix_history.encode(nodes, epoch, version);
+}
+
+void CoreNet::matrix_base(const UUID& remote_node, uint64_t& epoch, uint64_t& version) const
+{
+	auto p = bases_layout == nodes.layout() ? matrix_bases.find(remote_node) : matrix_bases.end();
+	epoch = p == matrix_bases.end() ? 0 : p->second.epoch;
+	version = p == matrix_bases.end() ? 0 : p->second.version;
+}
+
+void CoreNet::update_matrix(const UUID& remote_node, const string& data)
+{
+	MatrixBase& base = matrix_bases[remote_node];
+	auto old_ids = base.ids;
+	MatrixDelta delta = MatrixDelta::decode(data, base);
+	// Nodes are usually the same for all remote nodes, keep one copy of them
+	if (base.ids != old_ids)
+		for (const auto& b : matrix_bases)
+			if (b.second.ids != base.ids && *b.second.ids == *base.ids) {
+				base.ids = b.second.ids;
+				break;
+			}
+	Core::update_matrix(delta);
+	/* Cells of nodes unknown here are dropped by update, so after nodes are
+	 * changed old bases miss them. Only full matrix got just now is kept */
+	if (bases_layout != nodes.layout()) {
+		MatrixBase b = base;
+		matrix_bases.clear();
+		if (delta.full)
+			matrix_bases.emplace(remote_node, std::move(b));
+		bases_layout = nodes.layout();
+	}
+}
+
 void CoreNet::delnoderecord(const UUID& id)
 {
+	matrix_bases.erase(id);
 	const auto p = nodes.find(id);
 	if (p != nodes.end())
 		erase_if(ips, [&p](const auto& x) { return x.second == &p->second; });
@@ -1,6 +1,8 @@
 #pragma once
 #include <atomic>
 #include "core.h"
+#include "matrixdelta.h"
+#include "merkle.h"
 
 struct TCPHeloMsg {
 	UUID node_id;
@@ -22,12 +24,30 @@ struct MsgRequest : MsgId {
 	operator bool() const;
 };
 
+// Commands of node with numbers from 'first' till 'last' exclusively
+struct MsgRange {
+	UUID node_id;
+	size_t first;
+	size_t last;
+};
+
+// Commands requested by ranges (protocol 6). Keeps downloading_msgs flags (RAII)
+struct MsgRangeRequest {
+	MsgRangeRequest() = default;
+	MsgRangeRequest(const MsgRangeRequest&) = delete;
+	MsgRangeRequest(MsgRangeRequest&&) = default;
+	~MsgRangeRequest();
+	MsgRangeRequest& operator=(const MsgRangeRequest&) = delete;
+	std::vector<MsgRange> ranges;
+};
+
 struct CoreNet : Core {
 	CoreNet(Config& c);
 
 protected:
 	// Get UPD message to send
 	UDPcrypted broadcast_helo_v1();
+	UDPcrypted broadcast_helo_v2();
 
 	// return ipv6 group based no group-id
 	in6_addr ipv6_group() const;
@@ -41,8 +61,11 @@ protected:
 
 	void update_my_hash();
 
-	// Add info about node based on UPD message
-	void add_node(const UUID& id, const IN6ad& ad, const SHA256& hash, bool initialized);
+	// Update root of Merkle tree over row of this node and return it
+	const SHA256& calc_row_hash();
+
+	// Add info about node based on UPD message. Empty row_hash is ignored
+	void add_node(const UUID& id, const IN6ad& ad, const SHA256& hash, const SHA256& row_hash, bool initialized);
 
 	// Del network address
 	void del_addr(const IN6ad& ad);
@@ -50,14 +73,33 @@ protected:
 	// Return true if there is some reason to communicate with parameter node
 	bool need_communicate(const Node& n) const;
 
-	// return network address to connect by client or empry address
-	IN6ad addr_to_connect(bool server_busy, const UUID& conn_id);
+	// Return true if parameter node knows other commands than this one
+	bool need_messages(const Node& n) const;
 
-	TCPHeloMsg get_tcp_helo() const;
+	/* return network address to connect by client or empry address.
+	 * Nodes in 'busy' have sessions with this node already and are skipped.
+	 * node_id is set to node of address if it is known */
+	IN6ad addr_to_connect(const std::set<UUID>& busy, UUID& node_id);
+
+	TCPHeloMsg get_tcp_helo();
 
 	void delnoderecord(const UUID&) override;
 
-	MsgRequest request_message_from_node(const UUID& remote_node) const;
+	/* Next command unknown to this node and known to remote one. It is
+	 * added to downloading_msgs, so other sessions skip it */
+	MsgRequest request_message_from_node(const UUID& remote_node);
+
+	/* Up to 'limit' commands unknown to this node and known to remote one.
+	 * They are added to downloading_msgs, so other sessions skip them */
+	MsgRangeRequest request_messages_from_node(const UUID& remote_node, size_t limit);
+
+	/* Matrix exchange of protocol 2, see matrixdelta.h.
+	 * Matrix for node which has got specified version of it */
+	std::string matrix_delta(uint64_t epoch, uint64_t version);
+	// Version of matrix of remote node got by this node
+	void matrix_base(const UUID& remote_node, uint64_t& epoch, uint64_t& version) const;
+	// Merge matrix got from remote node
+	void update_matrix(const UUID& remote_node, const std::string&);
 
 	// Execute new commands, remove old, update hash, send UPD
 	void pending_commands();
@@ -69,4 +111,11 @@ protected:
 
 	std::set<MsgId> downloading_msgs;
 
+	MatrixHistory matrix_history;
+	std::map<UUID, MatrixBase> matrix_bases; // remote node -> its matrix got last time
+	size_t bases_layout = 0; // layout of nodes when matrix_bases are valid
+
+	RowTree row_tree; // over row of this node
+	SHA256 my_row_hash {};
+
 };
@@ -6,10 +6,15 @@
 #include <bsd/string.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <libintl.h>
 #include <iostream>
+#include <algorithm>
 #include <cassert>
-#include "alarmer.h"
+#include <cstring>
+#include "signals.h"
 #include "warn.h"
 #include "showdebug.h"
 #include "main.h"
@@ -24,12 +29,14 @@ using std::min;
 using std::move;
 using std::flush;
 using std::map;
+using std::set;
 using std::vector;
 using std::mutex;
 using std::string;
 using std::thread;
 using std::exception;
 using std::uniform_int_distribution;
+using std::chrono::milliseconds;
 typedef std::lock_guard<mutex> lock;
 typedef std::unique_lock<mutex> ulock;
 
@@ -94,10 +101,36 @@ MsgRequest::operator bool() const
 	return node_id;
 }
 
+// ===== MsgRangeRequest =====
+
+MsgRangeRequest::~MsgRangeRequest()
+{
+	if (!ranges.empty())
+		dmn->del_msg_requests(ranges);
+}
+
+// ===== PeerLock =====
+
+PeerLock::~PeerLock()
+{
+	for (const UUID& id : ids)
+		dmn->del_session(id);
+}
+
+bool PeerLock::add(const UUID& id)
+{
+	if (std::find(ids.begin(), ids.end(), id) != ids.end())
+		return true;
+	if (!dmn->add_session(id))
+		return false;
+	ids.push_back(id);
+	return true;
+}
+
 // ===== Daemon =====
 
 TCPheloNB::TCPheloNB(const TCPHeloMsg& hm, const IN6ad& a, CryptKey& k) :
-	ad(a), key(&k)
+	ad(a), key(&k), version(hm.version)
 {
 	p_out.nonce.random(rnd);
 	p_out.random.random(rnd);
@@ -147,19 +180,33 @@ void TCPheloNB::on_write(pollfd& pfd)
 			return;
 		pfd.events &= ~POLLOUT;
 		complete = true;
-		fsync(pfd.fd);
 	} else if (!x)
 		pfd.revents |= POLLHUP;
 	else if (errno != EAGAIN && errno != EINTR)
 		pfd.revents |= POLLERR;
 }
 
+// ===== EventSource =====
+
+EventSource::EventSource(Kind k, int fd, short events) :
+	kind(k),
+	pfd {fd, events, 0}
+{
+}
+
 // ===== TCPsession_v1 =====
 
-TCPsession_v1::TCPsession_v1(TCPconn& c) :
+// Sessions of protocol 7 use records authenticated by AES-GCM
+static StreamCipher session_cipher(short version)
+{
+	return version >= 7 ? StreamCipher::gcm : StreamCipher::cfb8;
+}
+
+TCPsession_v1::TCPsession_v1(TCPconn& c, short v) :
 	conn(c),
-	fcout(c.fout, dmn->crypt_key),
-	fcin(c.fin, dmn->crypt_key)
+	fcout(c.fout, dmn->crypt_key, session_cipher(v)),
+	fcin(c.fin, dmn->crypt_key, session_cipher(v)),
+	version(v)
 {
 }
 
@@ -180,7 +227,7 @@ void TCPsession_v1::initialize_me()
 
 void TCPsession_v1::initialize_that()
 {
-	dmn->write_net_initializer(fcin, fcout);
+	dmn->write_net_initializer(fcin, fcout, version);
 }
 
 bool TCPsession_v1::initialize()
@@ -199,7 +246,19 @@ bool TCPsession_v1::initialize()
 
 void TCPsession_v1::client_main()
 {
-	dmn->update_matrix(Matrix::read(fcin));
+	if (version >= 2) {
+		uint64_t base[2];
+		dmn->matrix_base(remote_id, base[0], base[1]);
+		fcout.write(base, sizeof(base));
+		fcout.write_hash();
+		fcout.flush_net();
+		dmn->update_matrix(remote_id, fcin.read_string());
+	} else
+		dmn->update_matrix(Matrix::read(fcin));
+	if (version >= 6) {
+		request_messages();
+		return;
+	}
 	while (prog_status == ProgramStatus::work) {
 		MsgRequest req = dmn->request_message_from_node(remote_id);
 		debug << "Request message " << string(req.node_id) << '/' << req.msg_number;
@@ -220,22 +279,88 @@ void TCPsession_v1::client_main()
 
 void TCPsession_v1::server_main()
 {
-	dmn->write_matrix(fcout);
+	if (version >= 2) {
+		uint64_t base[2];
+		fcin.read(base, sizeof(base));
+		fcin.check_hash();
+		fcout.write_string(dmn->matrix_delta(base[0], base[1]));
+	} else
+		dmn->write_matrix(fcout);
 	fcout.flush_net();
+	if (version >= 6) {
+		send_messages();
+		return;
+	}
 	while (prog_status == ProgramStatus::work) {
-		MsgRequest req;
+		MsgId req; // downloading_msgs flag is kept by client
 		fcin.read(&req, sizeof(req));
 		fcin.check_hash();
-		if (!req)
+		if (!req.node_id)
 			break;
 		debug << "Asked for command uuid=" << string(req.node_id) << ", N= " << req.msg_number;
-		const Msg * c = dmn->find_command(req);
-		if (c == nullptr)
-			throw exc_error("Requested command not found");
-		debug << "Send command uuid=" << string(c->node_id) << ", N= " << c->msg_number;
-		fcout.write_json(c->as_json());
+		const Msg c = dmn->load_command(req);
+		debug << "Send command uuid=" << string(c.node_id) << ", N= " << c.msg_number;
+		fcout.write_string(c.encoded());
+		fcout.write_hash();
+		dmn->after_write(fcout, c);
+		fcout.flush_net();
+	}
+}
+
+/* Protocol 6: client requests ranges of up to max_requested_msgs commands
+ * at once, server writes them without waiting. Empty request ends it */
+static const size_t max_requested_msgs = 1000;
+
+void TCPsession_v1::request_messages()
+{
+	while (prog_status == ProgramStatus::work) {
+		MsgRangeRequest req = dmn->request_messages_from_node(remote_id, max_requested_msgs);
+		size_t cnt = req.ranges.size();
+		debug << "Request " << cnt << " ranges of messages";
+		fcout.write(&cnt, sizeof(cnt));
+		fcout.write(req.ranges.data(), cnt * sizeof(MsgRange));
 		fcout.write_hash();
-		dmn->after_write(fcout, *c);
+		fcout.flush_net();
+		if (!cnt)
+			break;
+
+		for (const MsgRange& r : req.ranges)
+			for (size_t k = r.first; k < r.last; k++) {
+				Msg c(fcin.read_json());
+				if (c.node_id != r.node_id || c.msg_number != k)
+					throw exc_error("Bad responce");
+				fcin.check_hash();
+				dmn->after_read(fcin, c);
+				dmn->add_cmd(move(c));
+			}
+	}
+}
+
+void TCPsession_v1::send_messages()
+{
+	while (prog_status == ProgramStatus::work) {
+		size_t cnt;
+		fcin.read(&cnt, sizeof(cnt));
+		if (cnt > max_requested_msgs)
+			throw exc_error("Bad request");
+		vector<MsgRange> ranges(cnt);
+		fcin.read(ranges.data(), cnt * sizeof(MsgRange));
+		fcin.check_hash();
+		if (!cnt)
+			break;
+		size_t total = 0;
+		for (const MsgRange& r : ranges)
+			if (r.last < r.first || (total += r.last - r.first) > max_requested_msgs)
+				throw exc_error("Bad request");
+		debug << "Asked for " << total << " commands";
+
+		for (const MsgRange& r : ranges)
+			for (size_t k = r.first; k < r.last; k++) {
+				const Msg c = dmn->load_command(MsgId(r.node_id, k));
+				fcout.write_string(c.encoded());
+				fcout.write_hash();
+				dmn->after_write(fcout, c);
+			}
 		fcout.flush_net();
 	}
 }
@@ -259,25 +384,22 @@ ThreadCtrl::ThreadCtrl(ThreadCV * cv, void (Daemon::* f)(ThreadCV *)) :
 	tcv(cv),
 	thr(&ThreadCtrl::run, this)
 {
-	tcv->done = false;
 }
 
 ThreadCtrl::~ThreadCtrl()
 {
 	if (!thr.joinable())
 		return;
-	alarm_thread(thr_id);
-	while (!tcv->done) {
-		tcv->cv.notify_all();
-		nsleep();
+	{
+		// Thread checks program status with lock, so it can't miss notify
+		lock lk(tcv->mtx);
 	}
+	tcv->cv.notify_all();
 	thr.join();
-	alarm_stop(thr_id);
 }
 
 void ThreadCtrl::run()
 {
-	thr_id = pthread_self();
 	(dmn->*func)(tcv);
 }
 
@@ -292,16 +414,17 @@ UnixSession::UnixSession(int conn_fd) :
 UnixSession::~UnixSession()
 {
 	stop = true;
-	alarm_thread(thr_id);
+	// Interrupt read()
+	shutdown(fd, SHUT_RD);
 	thr.join();
-	alarm_stop(thr_id);
+	close(fd);
 }
 
 void UnixSession::run()
 {
-	thr_id = pthread_self();
 	try {
-		__gnu_cxx::stdio_filebuf<char> filebuf_out(fd, std::ios::out);
+		// It closes own descriptor, session's one is closed by destructor
+		__gnu_cxx::stdio_filebuf<char> filebuf_out(dup(fd), std::ios::out);
 		std::iostream os(&filebuf_out);
 		warn_thread_local = &os;
 		string line;
@@ -318,7 +441,9 @@ void UnixSession::run()
 	} catch (const exception& exc) {
 		warn << exc.what();
 	}
+	shutdown(fd, SHUT_RDWR);
 	stop = true;
+	dmn->notify();
 }
 
 bool UnixSession::getline(string& res) const
@@ -347,15 +472,44 @@ bool UnixSession::getline(string& res) const
 
 // ===== Daemon =====
 
-Daemon::Daemon(Config& c) : CoreBase(c), CoreMT(c), server_busy(false)
+Daemon::Daemon(Config& c) : CoreBase(c), CoreMT(c), execsv(c)
 {
 	dmn = this;
 	thr_id = pthread_self();
+	notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (notify_fd == -1)
+		throw exc_errno("eventfd");
+}
+
+Daemon::~Daemon()
+{
+	close(notify_fd);
 }
 
 void Daemon::notify() const
 {
-	alarm_thread(thr_id);
+	uint64_t x = 1;
+	// No warn, it is called by signal handler too
+	if (write(notify_fd, &x, sizeof(x)) < 0)
+		return;
+}
+
+void Daemon::notify_clients()
+{
+	for (ThreadCV& c : clients)
+		c.cv.notify_one();
+}
+
+bool Daemon::add_session(const UUID& id)
+{
+	lock lk(sessions_mtx);
+	return sessions.insert(id).second;
+}
+
+void Daemon::del_session(const UUID& id)
+{
+	lock lk(sessions_mtx);
+	sessions.erase(id);
 }
 
 int Daemon::open_udp_listen_socket(const char * if_name, unsigned if_idx) const
@@ -437,7 +591,7 @@ int Daemon::open_tcp_listen_socket(const char * if_name, bool dev_specified) con
 	return s;
 }
 
-void Daemon::recv_udp_v1(const UDPmessage_v1& msg, const IFName& if_name, sockaddr_in6& sa)
+void Daemon::recv_udp_v1(const UDPmessage_v1& msg, const IFName& if_name, sockaddr_in6& sa, const SHA256& row_hash)
 {
 	if (msg.group_id != group_id || msg.node_id == my_id) {
 		debug << "ignore this UDP";
@@ -451,8 +605,8 @@ void Daemon::recv_udp_v1(const UDPmessage_v1& msg, const IFName& if_name, sockad
 		if (need_initialize())
 			break;
 	case UDPmessage_v1::Command::helo:
-		add_node(msg.node_id, ad, msg.node_hash, msg.message == UDPmessage_v1::Command::helo);
-		client.cv.notify_one();
+		add_node(msg.node_id, ad, msg.node_hash, row_hash, msg.message == UDPmessage_v1::Command::helo);
+		notify_clients();
 		break;
 	case UDPmessage_v1::Command::bye:
 		del_addr(ad);
@@ -462,6 +616,19 @@ void Daemon::recv_udp_v1(const UDPmessage_v1& msg, const IFName& if_name, sockad
 	}
 }
 
+void Daemon::recv_udp_v2(const UDPmessage_v2& msg, const IFName& if_name, sockaddr_in6& sa)
+{
+	// Other fields are the same as in version 1
+	UDPmessage_v1 m;
+	m.version = 1;
+	m.message = msg.message;
+	m.counter = msg.counter;
+	m.group_id = msg.group_id;
+	m.node_id = msg.node_id;
+	m.node_hash = msg.node_hash;
+	recv_udp_v1(m, if_name, sa, msg.row_hash);
+}
+
 void Daemon::recv_udp(int fd, const IFName& if_name)
 {
 	UDPcrypted buf;
@@ -485,6 +652,12 @@ void Daemon::recv_udp(int fd, const IFName& if_name)
 		else
 			warn << "Bad UDP";
 		break;
+	case 2:
+		if (x == sizeof(Nonce) + sizeof(UDPmessage_v2))
+			recv_udp_v2(buf.msg.v2, if_name, sa);
+		else
+			warn << "Bad UDP";
+		break;
 	default:
 		warn << "Unknown UDP";
 		return;
@@ -497,19 +670,38 @@ void Daemon::client_act()
 	while(prog_status == ProgramStatus::work) {
 		unsigned timeout = uniform_int_distribution<unsigned>(1, 8)(rd);
 		nsleep(timeout);
-		IN6ad ad = addr_to_connect(server_busy, serv_helo.node_id);
+		set<UUID> busy;
+		{
+			lock lk(sessions_mtx);
+			busy = sessions;
+		}
+		UUID node_id;
+		IN6ad ad = addr_to_connect(busy, node_id);
 		if (!ad || prog_status != ProgramStatus::work)
 			break;
+		PeerLock peer;
+		if (node_id && !peer.add(node_id))
+			continue;
 
 		try {
 			debug << "Try connect to " << ad.name();
 			TCPconn conn(ad, cfg.port);
 			TCPHeloMsg helo = client_connect(conn);
+			if (!peer.add(helo.node_id)) {
+				debug << "Node is busy by other session";
+				continue;
+			}
 			update_node_hash(helo.node_id, helo.node_hash);
 
 			switch (helo.version) {
-			case 1: {
-					TCPsession_v1 sess(conn);
+			case 1:
+			case 2:
+			case 3:
+			case 4:
+			case 5:
+			case 6:
+			case 7: {
+					TCPsession_v1 sess(conn, helo.version);
 					sess.remote_id = helo.node_id;
 					sess.remote_initialized = helo.initialized;
 					if (sess.initialize())
@@ -557,17 +749,23 @@ void Daemon::client_main_loop(ThreadCV * t)
 			break;
 		client_act();
 	}
-	t->done = true;
 }
 
-void Daemon::server_act()
+void Daemon::server_act(ServerSlot& slot)
 {
+	const TCPHeloMsg& serv_helo = slot.helo;
 	try {
-		TCPconn conn(pass_server_fd, pass_server_fname);
+		TCPconn conn(slot.fd, slot.fname);
 		update_node_hash(serv_helo.node_id, serv_helo.node_hash);
 		switch(serv_helo.version) {
-		case 1: {
-				TCPsession_v1 sess(conn);
+		case 1:
+		case 2:
+		case 3:
+		case 4:
+		case 5:
+		case 6:
+		case 7: {
+				TCPsession_v1 sess(conn, serv_helo.version);
 				sess.remote_id = serv_helo.node_id;
 				sess.remote_initialized = serv_helo.initialized;
 				if (sess.initialize())
@@ -591,6 +789,7 @@ void Daemon::server_act()
 	} catch (const exception& exc) {
 		warn << "Client disconnected: " << exc.what();
 	}
+	del_session(serv_helo.node_id);
 
 	if (prog_status != ProgramStatus::work)
 		return;
@@ -600,19 +799,29 @@ void Daemon::server_act()
 	} catch (const exception& exc) {
 		warn << exc.what();
 	}
-	server_busy = false;
+	slot.busy = false;
 	debug << "Server complete";
 }
 
 bool Daemon::serve(const TCPHeloMsg& p_in, const IN6ad& ad, int fd)
 {
-	add_node(p_in.node_id, ad, p_in.node_hash, p_in.initialized);
-	bool free = false;
-	bool ok = server_busy.compare_exchange_weak(free, true);
-	if (!ok) {
+	add_node(p_in.node_id, ad, p_in.node_hash, SHA256(), p_in.initialized);
+	ServerSlot * slot = nullptr;
+	if (add_session(p_in.node_id)) {
+		for (ServerSlot& s : servers) {
+			bool free = false;
+			if (s.busy.compare_exchange_strong(free, true)) {
+				slot = &s;
+				break;
+			}
+		}
+		if (!slot)
+			del_session(p_in.node_id);
+	}
+	if (!slot) {
 		debug << "I'm busy, disconnect";
 		closefile(fd, ad.name());
-		client.cv.notify_one();
+		notify_clients();
 		return false;
 	}
 	if (!check_msg_cnt(p_in.node_id, p_in.msg_cnt)) {
@@ -620,28 +829,113 @@ bool Daemon::serve(const TCPHeloMsg& p_in, const IN6ad& ad, int fd)
 		//closefile(fd, ad.name());
 		//throw exc_error("Possible network spoofing detected");
 	}
-	pass_server_fd = fd;
-	pass_server_fname = ad.name();
-	serv_helo = p_in;
+	{
+		lock lk(slot->mtx);
+		slot->fd = fd;
+		slot->fname = ad.name();
+		slot->helo = p_in;
+		slot->pending = true;
+	}
 	int oldfl = fcntl(fd, F_GETFL);
 	if (oldfl < 0)
 		error(errno, errno, "fcntl");
 	if (fcntl(fd, F_SETFL, oldfl & ~O_NONBLOCK) < 0)
 		error(errno, errno, "fcntl");
-	server.cv.notify_one();
+	slot->cv.notify_one();
 	return true;
 }
 
 void Daemon::server_main_loop(ThreadCV * t)
 {
+	ServerSlot& slot = static_cast<ServerSlot&>(*t);
 	ulock lk(t->mtx);
 	while (prog_status == ProgramStatus::work) {
-		t->cv.wait(lk);
+		t->cv.wait(lk, [&slot] { return slot.pending || prog_status != ProgramStatus::work; });
 		if (prog_status != ProgramStatus::work)
 			break;
-		server_act();
+		slot.pending = false;
+		server_act(slot);
+	}
+}
+
+void Daemon::save(bool force)
+{
+	{
+		lock lk(saver.mtx);
+		if (saver_running) {
+			save_requested = true;
+			save_forced |= force;
+			saver.cv.notify_one();
+			return;
+		}
+	}
+	CoreMT::save(force);
+}
+
+void Daemon::saver_act(bool force)
+{
+	bool again = true;
+	while (again) {
+		SaveJob job;
+		if (!prepare_save(job, force))
+			return;
+		force = false;
+		bool ok = true;
+		try {
+			write_save(job);
+		} catch (const exception& exc) {
+			warn << exc.what();
+			ok = false;
+		}
+		again = finish_save(job, ok) && ok;
+	}
+}
+
+void Daemon::saver_main_loop(ThreadCV * t)
+{
+	ulock lk(t->mtx);
+	saver_running = true;
+	while (prog_status == ProgramStatus::work || save_requested) {
+		if (!save_requested) {
+			t->cv.wait(lk);
+			continue;
+		}
+		// Let other changes come to save them at once
+		t->cv.wait_for(lk, milliseconds(cfg.save_delay), [] { return prog_status != ProgramStatus::work; });
+		bool force = save_forced;
+		save_requested = save_forced = false;
+		lk.unlock();
+		try {
+			saver_act(force);
+		} catch (const exception& exc) {
+			warn << exc.what();
+		}
+		lk.lock();
+	}
+	saver_running = false;
+}
+
+bool Daemon::exec_start(const MsgId& id, const string& cmdline)
+{
+	return execsv.start(id, cmdline);
+}
+
+void Daemon::exec_finished(const MsgId& id, ExecOutput&& res)
+{
+	exec_done(id, res);
+	if (res.cancelled)
+		return;
+	pending_commands();
+	save();
+}
+
+void Daemon::executor_main_loop(ThreadCV *)
+{
+	try {
+		execsv.run([this](const MsgId& id, ExecOutput&& res) { exec_finished(id, move(res)); });
+	} catch (const exception& exc) {
+		warn << exc.what();
 	}
-	t->done = true;
 }
 
 TCPHeloMsg Daemon::client_connect(TCPconn& conn)
@@ -706,8 +1000,12 @@ void Daemon::daemon()
 		}
 	}
 	broadcast_bye();
+	save();
 }
 
+// Update info and run pending commands at least so often (seconds)
+static const time_t periodic_work_interval = 60 * 60;
+
 void Daemon::daemon_run()
 {
 	warn << "DAEMON RUN";
@@ -719,140 +1017,174 @@ void Daemon::daemon_run()
 	if (!group_id)
 		error(1, 0, "Distadm-network not initialized");
 	prog_status = ProgramStatus::work;
+	execsv.open();
+	ThreadCtrl exr(&executor, &Daemon::executor_main_loop);
 	pending_commands();
 	save();
 
 	UnixServerSocket usshp(unix_socket_name(), true);
 	UnixServerSocket usslp(unix_socket_name_lp(), false);
-	vector<pollfd> pollfds; // system + udp-listener + tcp-listener + tls_sessions
-	vector<IFName> udp_ifn; // udp-listener: network interface names for file descriptors
-	vector<TCPheloNB> tcpnb;
-	const size_t sys_idx = 2; // one unix socket
-	size_t udp_idx;
-	size_t tcp_idx;
-	pollfds.push_back(pollfd { usshp.fd, POLLIN, 0 });
-	pollfds.push_back(pollfd { usslp.fd, POLLIN, 0 });
-
-	{
-		int i = sys_idx;
-		map<IFName, unsigned> indices = if_indices();
-		for(const IFName& x : cfg.listen) {
-			auto p = indices.find(x);
-			if (p == indices.end())
-				continue;
-			int fd = open_udp_listen_socket(p->first.dev, p->second);
-			if (fd < 0)
-				continue;
-			udp_ifn.push_back(x);
-			pollfds.push_back(pollfd { fd, POLLIN, 0 });
-			i++;
-		}
-		udp_idx = i;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		error(errno, errno, "epoll_create1");
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timer_fd < 0)
+		error(errno, errno, "timerfd_create");
+	const itimerspec period {{periodic_work_interval, 0}, {periodic_work_interval, 0}};
+	timerfd_settime(timer_fd, 0, &period, nullptr);
+	sources.clear();
+	watch(EventSource::Kind::notify, notify_fd);
+	watch(EventSource::Kind::timer, timer_fd);
+	watch(EventSource::Kind::unix_hp, usshp.fd);
+	watch(EventSource::Kind::unix_lp, usslp.fd);
+
+	map<IFName, unsigned> indices = if_indices();
+	for(const IFName& x : cfg.listen) {
+		auto p = indices.find(x);
+		if (p == indices.end())
+			continue;
+		int fd = open_udp_listen_socket(p->first.dev, p->second);
+		if (fd >= 0)
+			watch(EventSource::Kind::udp, fd).ifn = x;
 	}
 	if(cfg.listen_specified) {
-		int i = udp_idx;
 		for(const IFName& x : cfg.listen) {
 			int fd = open_tcp_listen_socket(x.dev, true);
-			if (fd < 0)
-				continue;
-			pollfds.push_back(pollfd { fd, POLLIN, 0 });
-			i++;
+			if (fd >= 0)
+				watch(EventSource::Kind::tcp_listen, fd);
 		}
-		tcp_idx = i;
 	} else {
-		int i = udp_idx;
 		int fd = open_tcp_listen_socket(0, false);
-		if (fd >= 0) {
-			pollfds.push_back(pollfd { fd, POLLIN, 0 });
-			i++;
-		}
-		tcp_idx = i;
+		if (fd >= 0)
+			watch(EventSource::Kind::tcp_listen, fd);
 	}
-	ThreadCtrl srv(&server, &Daemon::server_main_loop);
-	ThreadCtrl clnt(&client, &Daemon::client_main_loop);
+	ThreadCtrl svr(&saver, &Daemon::saver_main_loop);
+	servers.clear();
+	clients.clear();
+	std::list<ThreadCtrl> sessions_thr;
+	for (unsigned i = 0; i < cfg.server_sessions; i++)
+		sessions_thr.emplace_back(&servers.emplace_back(), &Daemon::server_main_loop);
+	for (unsigned i = 0; i < cfg.client_sessions; i++)
+		sessions_thr.emplace_back(&clients.emplace_back(), &Daemon::client_main_loop);
 
 
 	sleep(1);
 	broadcast_helo();
 
+	vector<epoll_event> events(64);
 	while (prog_status == ProgramStatus::work) {
-		int ready = poll(pollfds.data(), pollfds.size(), 60 * 60 * 1000);
+		int ready = epoll_wait(epoll_fd, events.data(), events.size(), -1);
 		if (prog_status != ProgramStatus::work)
 				break;
-		if (ready < 0) {
-			if (errno == EINTR) {
-				alarm_stop(thr_id);
-				clear_usl();
-			}
-			else
-				error(errno, errno, "poll");
+		if (ready < 0 && errno != EINTR)
+			error(errno, errno, "epoll_wait");
+		// Source is removed only by own event, so others of this array stay valid
+		for (int i = 0; i < ready; i++) {
+			EventSource& src = *(EventSource *)events[i].data.ptr;
+			src.pfd.revents = events[i].events;
+			on_event(src);
 		}
-		for(size_t i = 0; i < pollfds.size(); i++) {
-			if (pollfds[i].revents & POLLIN) {
-				if (!i)
-					recv_unix(pollfds[i].fd);
-				else if (i < sys_idx) {
-					update_info();
-					pending_commands();
-					recv_unix_lp(pollfds[i].fd);
-				} else if (i >= sys_idx && i < udp_idx)
-					recv_udp(pollfds[i].fd, udp_ifn[i - sys_idx]);
-				else if (i < tcp_idx) {
-					sockaddr_in6 sa;
-					socklen_t sa_size = sizeof(sa);
-					int connfd = accept4(pollfds[i].fd, (struct sockaddr*)&sa, &sa_size, SOCK_NONBLOCK);
-					if (connfd >= 0 && sa_size == sizeof(sa)) {
-						char addrname[INET6_ADDRSTRLEN] { '\0' };
-						inet_ntop(sa.sin6_family, &sa.sin6_addr, addrname, sizeof(addrname));
-						debug << "received TCP from " << addrname;
-						socket_timeouts(connfd);
-						IN6ad ad(sa.sin6_addr, get_ifname(connfd));
-						pollfds.emplace_back(pollfd {connfd, POLLIN | POLLOUT, 0});
-						tcpnb.emplace_back(dmn->get_tcp_helo(), move(ad), crypt_key);
-					} else
-						pollfds[i].revents = POLLERR;
-				} else
-					tcpnb[i - tcp_idx].on_read(pollfds[i]);
-				pollfds[i].revents &= ~POLLIN;
-			}
-			if (pollfds[i].revents & POLLOUT) {
-				tcpnb[i - tcp_idx].on_write(pollfds[i]);
-				pollfds[i].revents &= ~POLLOUT;
-			}
+		if (status == NodeStatus::work || status == NodeStatus::inviter) {
+			update_info();
+			pending_commands();
+		}
+		save();
+	}
+	execsv.wake();
+	for (EventSource& src : sources)
+		if (src.kind != EventSource::Kind::notify && src.kind != EventSource::Kind::unix_hp && src.kind != EventSource::Kind::unix_lp)
+			close(src.pfd.fd);
+	sources.clear();
+	close(epoll_fd);
+	epoll_fd = -1;
+}
 
-			if (pollfds[i].revents & (POLLERR | POLLHUP)) {
-				if (i < sys_idx)
-					error(errno, errno, "poll unix socket");
-				else if (i < udp_idx) {
-					close(pollfds[i].fd);
-					udp_ifn.erase(udp_ifn.begin() + i - sys_idx);
-					pollfds.erase(pollfds.begin() + i);
-					udp_idx--;
-					tcp_idx--;
-				} else if (i < tcp_idx) {
-					close(pollfds[i].fd);
-					pollfds.erase(pollfds.begin() + i);
-					tcp_idx--;
-				} else {
-					tcpnb.erase(tcpnb.begin() + i - tcp_idx);
-					close(pollfds[i].fd);
-					pollfds.erase(pollfds.begin() + i);
-				}
+EventSource& Daemon::watch(EventSource::Kind kind, int fd, short events)
+{
+	EventSource& src = sources.emplace_back(kind, fd, events);
+	src.self = prev(sources.end());
+	epoll_event ev {uint32_t(events), {.ptr = &src}};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		error(errno, errno, "epoll_ctl");
+	return src;
+}
+
+void Daemon::unwatch(EventSource& src)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, src.pfd.fd, nullptr);
+	sources.erase(src.self);
+}
+
+void Daemon::on_event(EventSource& src)
+{
+	pollfd& pfd = src.pfd;
+	const short events = pfd.events;
+	if (pfd.revents & POLLIN) {
+		switch (src.kind) {
+		case EventSource::Kind::notify:
+		case EventSource::Kind::timer: {
+				uint64_t x;
+				if (read(pfd.fd, &x, sizeof(x)) < 0 && errno != EAGAIN)
+					warn << "eventfd: " << strerror(errno);
+				if (src.kind == EventSource::Kind::notify)
+					clear_usl();
 			}
-		}
-		for (size_t i = 0; i < tcpnb.size(); i++) {
-			if (pollfds[i + tcp_idx].events & (POLLIN | POLLOUT))
-				continue;
-			serve(tcpnb[i].p_in.msg, tcpnb[i].ad, pollfds[i + tcp_idx].fd);
-			tcpnb.erase(tcpnb.begin() + i);
-			pollfds.erase(pollfds.begin() + i + tcp_idx);
-			i--;
-		}
-		if (status == NodeStatus::work || status == NodeStatus::inviter) {
+			break;
+		case EventSource::Kind::unix_hp:
+			recv_unix(pfd.fd);
+			break;
+		case EventSource::Kind::unix_lp:
 			update_info();
 			pending_commands();
+			recv_unix_lp(pfd.fd);
+			break;
+		case EventSource::Kind::udp:
+			recv_udp(pfd.fd, src.ifn);
+			break;
+		case EventSource::Kind::tcp_listen: {
+				sockaddr_in6 sa;
+				socklen_t sa_size = sizeof(sa);
+				int connfd = accept4(pfd.fd, (struct sockaddr*)&sa, &sa_size, SOCK_NONBLOCK);
+				if (connfd >= 0 && sa_size == sizeof(sa)) {
+					char addrname[INET6_ADDRSTRLEN] { '\0' };
+					inet_ntop(sa.sin6_family, &sa.sin6_addr, addrname, sizeof(addrname));
+					debug << "received TCP from " << addrname;
+					socket_timeouts(connfd);
+					IN6ad ad(sa.sin6_addr, get_ifname(connfd));
+					watch(EventSource::Kind::tcp_helo, connfd, POLLIN | POLLOUT).helo.emplace(get_tcp_helo(), move(ad), crypt_key);
+				} else
+					pfd.revents = POLLERR;
+			}
+			break;
+		case EventSource::Kind::tcp_helo:
+			src.helo->on_read(pfd);
+			break;
 		}
 	}
-	for (size_t i = sys_idx; i < pollfds.size(); i++)
-		close(pollfds[i].fd);
+	if (pfd.revents & POLLOUT)
+		src.helo->on_write(pfd);
+
+	if (pfd.revents & (POLLERR | POLLHUP)) {
+		if (src.kind == EventSource::Kind::unix_hp || src.kind == EventSource::Kind::unix_lp) {
+			error(errno, errno, "poll unix socket");
+			return;
+		}
+		close(pfd.fd);
+		unwatch(src);
+		return;
+	}
+	if (src.kind != EventSource::Kind::tcp_helo || pfd.events == events)
+		return;
+	if (pfd.events & (POLLIN | POLLOUT)) {
+		epoll_event ev {uint32_t(pfd.events), {.ptr = &src}};
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pfd.fd, &ev);
+		return;
+	}
+	// Handshake is complete
+	int fd = pfd.fd;
+	TCPHeloMsg msg = src.helo->p_in.msg;
+	msg.version = min(msg.version, src.helo->version);
+	IN6ad ad = src.helo->ad;
+	unwatch(src);
+	serve(msg, ad, fd);
 }
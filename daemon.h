@@ -2,8 +2,10 @@
 #include <list>
 #include <condition_variable>
 #include <thread>
+#include <optional>
 #include <ext/stdio_filebuf.h>
 #include "coremt.h"
+#include "execsv.h"
 
 struct TCPheloCrypted {
 	Nonce nonce;
@@ -21,6 +23,7 @@ struct TCPheloNB  {
 	TCPheloCrypted p_in, p_out;
 	IN6ad ad;
 	CryptKey * key;
+	short version; // sent to client, session uses min of it and client's
 	size_t size_to_write;
 	size_t written_size = 0;
 	size_t read_size = 0;
@@ -39,7 +42,38 @@ struct TCPhelo : TCPHeloMsg {
 struct ThreadCV {
 	std::mutex mtx;
 	std::condition_variable cv;
-	bool done = false;
+};
+
+// Descriptor watched by event loop of daemon (epoll)
+struct EventSource {
+	enum class Kind { notify, timer, unix_hp, unix_lp, udp, tcp_listen, tcp_helo };
+	EventSource(Kind, int fd, short events);
+	Kind kind;
+	pollfd pfd; // bits of events are the same for poll and epoll
+	IFName ifn; // network interface of udp listener
+	std::optional<TCPheloNB> helo; // handshake of accepted connection
+	std::list<EventSource>::iterator self;
+};
+
+// Server thread and connection passed to it
+struct ServerSlot : ThreadCV {
+	std::atomic_bool busy = false;
+	bool pending = false; // connection is passed, guarded by mtx
+	int fd;
+	std::string fname; // remote node network address
+	TCPHeloMsg helo; // this is what remote node send to our server
+};
+
+// Nodes which client session talks with, other sessions skip them (RAII)
+struct PeerLock {
+	PeerLock() = default;
+	PeerLock(const PeerLock&) = delete;
+	~PeerLock();
+	PeerLock& operator=(const PeerLock&) = delete;
+	// Return false if other session talks with the node
+	bool add(const UUID&);
+
+	std::vector<UUID> ids;
 };
 
 // unix socket connection
@@ -55,29 +89,49 @@ private:
 	bool getline(std::string&) const;
 	int fd;
 	std::thread thr;
-	pthread_t thr_id;
 };
 
 struct Daemon : CoreMT, virtual CoreBase {
 	Daemon(Config&);
+	~Daemon();
 
+	// Wake event loop. It is async-signal-safe
 	void notify() const override;
 	void daemon();
 
+	/* Ask saver thread to save changes. Changes arrived during save-delay
+	 * are saved together. Save immediately if saver is not running */
+	void save(bool force = false);
+
+	// Mark node as having session with this node. Return false if it has already
+	bool add_session(const UUID&);
+	void del_session(const UUID&);
+
 private:
 	TCPHeloMsg client_connect(TCPconn&);
 	void client_main_loop(ThreadCV *);
 	void server_main_loop(ThreadCV *);
 	void client_act();
-	void server_act();
+	void server_act(ServerSlot&);
+	void notify_clients();
+	void saver_main_loop(ThreadCV *);
+	void saver_act(bool force);
+	void executor_main_loop(ThreadCV *);
+	bool exec_start(const MsgId&, const std::string& cmdline) override;
+	void exec_finished(const MsgId&, ExecOutput&&);
 	void daemon_run();
+	EventSource& watch(EventSource::Kind, int fd, short events = POLLIN);
+	// Remove from event loop, descriptor is not closed
+	void unwatch(EventSource&);
+	void on_event(EventSource&);
 	void clear_usl();
 	void recv_unix(int ufd);
 	void recv_unix_lp(int ufd);
 
 	/* Called when UDP message arrived on specified listener socket and interface */
 	void recv_udp(int fd, const IFName&);
-	void recv_udp_v1(const UDPmessage_v1&, const IFName&, sockaddr_in6&);
+	void recv_udp_v1(const UDPmessage_v1&, const IFName&, sockaddr_in6&, const SHA256& row_hash = SHA256());
+	void recv_udp_v2(const UDPmessage_v2&, const IFName&, sockaddr_in6&);
 
 	// Open listener on specified interface name and it's index
 	int open_udp_listen_socket(const char * if_name, unsigned if_idx) const;
@@ -86,18 +140,33 @@ private:
 
 	bool serve(const TCPHeloMsg&, const IN6ad& ad, int fd);
 
-	// Thread where daemon running. Used for notify it
+	// Thread where daemon running
 	pthread_t thr_id;
 
-	// Server part
-	ThreadCV server;
-	int pass_server_fd;
-	std::string pass_server_fname; // remote node network address
-	std::atomic_bool server_busy;
-	TCPHeloMsg serv_helo; // this is what remote node send to our server
+	// Event loop
+	int notify_fd; // eventfd to wake event loop
+	int epoll_fd = -1;
+	std::list<EventSource> sources;
+
+	// Server part, cfg.server_sessions threads
+	std::list<ServerSlot> servers;
 
-	// Client part
-	ThreadCV client;
+	// Client part, cfg.client_sessions threads
+	std::list<ThreadCV> clients;
+
+	// Nodes having client or server sessions with this node
+	std::mutex sessions_mtx;
+	std::set<UUID> sessions;
+
+	// Saver part
+	ThreadCV saver;
+	bool saver_running = false;
+	bool save_requested = false;
+	bool save_forced = false;
+
+	// Programs of 'exec' commands
+	ThreadCV executor;
+	ExecSupervisor execsv;
 
 	// Unix socket part
 	std::list<UnixSession> usl;
@@ -110,12 +179,11 @@ struct ThreadCtrl {
 
 	void(Daemon::* func)(ThreadCV *);
 	ThreadCV * tcv;
-	pthread_t thr_id;
 	std::thread thr;
 };
 
 struct TCPsession_v1 {
-	TCPsession_v1(TCPconn& c);
+	TCPsession_v1(TCPconn& c, short version);
 	~TCPsession_v1();
 	bool initialize();
 	void initialize_me();
@@ -123,12 +191,16 @@ struct TCPsession_v1 {
 	void client_main();
 	void server_main();
 	bool xchg_bool(bool);
+	// Exchange of commands by ranges, protocol 6
+	void request_messages();
+	void send_messages();
 
 	TCPconn& conn;
 	OCCstream fcout;
 	ICCstream fcin;
 	bool remote_initialized;
 	UUID remote_id;
+	short version; // protocol version of session
 };
 
 extern Daemon * dmn;
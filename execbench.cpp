@@ -0,0 +1,137 @@
+/* Scheduling of backlog of commands by execute_pending_commands(): full scan
+ * of all commands for each executed one (before ExecQueue) and ExecQueue.
+ * Commands of several authors depend on commands of others known when they
+ * were created. Programs of commands are not run, only order is found and
+ * command_to_exec counters are advanced, like mark_as_executed() does.
+ * Full scan is quadratic, so it runs first scan_steps commands only and
+ * time of whole backlog is estimated: each step scans all commands.
+ * Build: make execbench. Run: ./execbench [commands] [authors] */
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include <json/json.h>
+#include "core.h"
+#include "execqueue.h"
+#include "main.h"
+
+using std::cout;
+using std::endl;
+using std::set;
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::uniform_int_distribution;
+typedef std::chrono::steady_clock Clock;
+
+ProgramStatus prog_status = ProgramStatus::work;
+ifstream rnd("/dev/urandom");
+Json::StreamWriterBuilder json_builder;
+Json::StreamWriterBuilder json_cbuilder;
+std::random_device rd;
+
+static const size_t scan_steps = 1000;
+
+static double seconds_since(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Command k is made by author k % authors and depends on all commands made before it
+static MsgStore backlog(const vector<UUID>& ids, size_t count)
+{
+	MsgStore res;
+	vector<size_t> made(ids.size());
+	for (size_t k = 0; k < count; k++) {
+		size_t a = k % ids.size();
+		Msg m(ids[a], made[a]++);
+		m.set_name("exec");
+		for (size_t j = 0; j < ids.size(); j++)
+			m.depends[ids[j]] = made[j] - (j == a);
+		res.insert(std::move(m));
+	}
+	return res;
+}
+
+static void mark_as_executed(Matrix& nodes, const Msg& m)
+{
+	nodes[m.node_id].command_to_exec++;
+}
+
+// Ready command chosen at random from all commands, as before ExecQueue
+static const Msg * scan(const MsgStore& messages, const Matrix& nodes)
+{
+	vector<const Msg *> vres;
+	for (const Msg& m : messages) {
+		auto n = nodes.find(m.node_id);
+		if (n == nodes.end() || n->second.command_to_exec != m.msg_number)
+			continue;
+		bool ok = true;
+		for (const auto& i : m.depends) {
+			auto p = nodes.find(i.first);
+			if (p != nodes.end() && p->second.command_to_exec < i.second) {
+				ok = false;
+				break;
+			}
+		}
+		if (ok)
+			vres.push_back(&m);
+	}
+	if (vres.empty())
+		return nullptr;
+	return vres[uniform_int_distribution<size_t>(0, vres.size() - 1)(rd)];
+}
+
+static size_t executed(const Matrix& nodes)
+{
+	size_t res = 0;
+	for (const auto& n : nodes)
+		res += n.second.command_to_exec;
+	return res;
+}
+
+int main(int argc, char ** argv)
+{
+	size_t count = argc > 1 ? std::stoul(argv[1]) : 50000;
+	size_t authors = argc > 2 ? std::stoul(argv[2]) : 10;
+	vector<UUID> ids(authors);
+	for (UUID& id : ids)
+		id.random(rnd);
+	MsgStore messages = backlog(ids, count);
+	Matrix nodes;
+	cout.precision(3);
+	cout << std::fixed;
+
+	nodes.init(ids);
+	Clock::time_point start = Clock::now();
+	size_t steps = 0;
+	for (; steps < scan_steps; steps++) {
+		const Msg * m = scan(messages, nodes);
+		if (!m)
+			break;
+		mark_as_executed(nodes, *m);
+	}
+	double t = seconds_since(start);
+	cout << "full scan: " << steps << " commands " << t << " s, whole backlog ~" <<
+		t / steps * count << " s" << endl;
+
+	nodes.init(ids);
+	const set<MsgId> running;
+	start = Clock::now();
+	ExecQueue queue(messages, nodes, running);
+	for (;;) {
+		vector<const Msg *> ready = queue.take();
+		if (ready.empty())
+			break;
+		for (const Msg * m : ready) {
+			mark_as_executed(nodes, *m);
+			queue.executed(m->node_id);
+		}
+	}
+	t = seconds_since(start);
+	cout << "ExecQueue: " << executed(nodes) << " of " << count << " commands " << t << " s" << endl;
+	return executed(nodes) == count ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+#include "execqueue.h"
+#include <random>
+#include <algorithm>
+#include "main.h"
+
+using std::set;
+using std::move;
+using std::vector;
+using std::shuffle;
+
+ExecQueue::ExecQueue(const MsgStore& messages, const Matrix& n, const set<MsgId>& r) :
+	nodes(&n),
+	running(&r),
+	msgs_cnt(messages.size()),
+	nodes_cnt(n.size())
+{
+	for (const Msg& m : messages)
+		place(&m);
+}
+
+void ExecQueue::place(const Msg * m)
+{
+	auto n = nodes->find(m->node_id);
+	if (n == nodes->end() || n->second.command_to_exec > m->msg_number)
+		return; // executed or author is unknown
+	if (n->second.command_to_exec < m->msg_number) {
+		waiting[MsgId(m->node_id, m->msg_number)].push_back(m);
+		return;
+	}
+	for (const auto& i : m->depends) {
+		auto p = nodes->find(i.first);
+		if (p == nodes->end())
+			continue;
+		if (p->second.command_to_exec < i.second) {
+			waiting[MsgId(i.first, i.second)].push_back(m);
+			return;
+		}
+	}
+	if (!running->contains(*m))
+		ready.push_back(m);
+}
+
+vector<const Msg *> ExecQueue::take()
+{
+	vector<const Msg *> res = move(ready);
+	ready.clear();
+	shuffle(res.begin(), res.end(), rd);
+	return res;
+}
+
+void ExecQueue::add(const Msg * m)
+{
+	msgs_cnt++;
+	place(m);
+}
+
+bool ExecQueue::valid(const MsgStore& messages, const Matrix& n) const
+{
+	return messages.size() == msgs_cnt && n.size() == nodes_cnt;
+}
+
+void ExecQueue::executed(const UUID& node_id)
+{
+	auto n = nodes->find(node_id);
+	if (n == nodes->end())
+		return;
+	auto p = waiting.find(MsgId(node_id, n->second.command_to_exec));
+	if (p == waiting.end())
+		return;
+	vector<const Msg *> w = move(p->second);
+	waiting.erase(p);
+	for (const Msg * m : w)
+		place(m);
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <map>
+#include <set>
+#include <vector>
+#include "core.h"
+
+/* Commands which can be executed now and commands waiting for others.
+ * Command is ready when it is next command of its author and all commands
+ * it depends on are executed. Waiting command is kept under the first
+ * condition it is blocked on: node and value of its command_to_exec
+ * counter to wait for. So executed command wakes only commands which wait
+ * for it and each command is checked not more than once per dependency.
+ * Queue keeps pointers to commands and nodes, it must be rebuilt if
+ * set of messages or nodes is changed */
+struct ExecQueue {
+	// Commands from running are not executed
+	ExecQueue(const MsgStore&, const Matrix&, const std::set<MsgId>& running);
+
+	/* Remove all ready commands from queue and return them in random order.
+	 * Commands are independent: each of them has its own author and
+	 * its dependencies are already executed */
+	std::vector<const Msg *> take();
+
+	// Put new command to queue
+	void add(const Msg *);
+
+	// Return false if messages or nodes are changed not through add()
+	bool valid(const MsgStore&, const Matrix&) const;
+
+	// Wake commands which wait for command_to_exec of node to grow to its current value
+	void executed(const UUID& node_id);
+private:
+	// Put command to ready list or to waiting commands
+	void place(const Msg *);
+
+	const Matrix * nodes;
+	const std::set<MsgId> * running;
+	std::vector<const Msg *> ready;
+	std::map<MsgId, std::vector<const Msg *>> waiting;
+	size_t msgs_cnt;
+	size_t nodes_cnt;
+};
@@ -0,0 +1,224 @@
+#include "execsv.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <error.h>
+#include <errno.h>
+#include <libintl.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <vector>
+#include <cstring>
+#include "main.h"
+#include "exc_error.h"
+#include "warn.h"
+#include "showdebug.h"
+#define _(STRING) gettext(STRING)
+
+using std::min;
+using std::move;
+using std::list;
+using std::mutex;
+using std::string;
+using std::vector;
+typedef std::lock_guard<mutex> lock;
+
+ExecSupervisor::ExecSupervisor(const Config& c) : cfg(c)
+{
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd == -1)
+		throw exc_errno("eventfd");
+}
+
+ExecSupervisor::~ExecSupervisor()
+{
+	close(wake_fd);
+}
+
+void ExecSupervisor::open()
+{
+	lock lk(mtx);
+	active = true;
+}
+
+pid_t ExecSupervisor::spawn(const string& cmdline, int& out, int& pidfd) const
+{
+	int pip[2];
+	if (pipe2(pip, O_CLOEXEC))
+		throw exc_errno(_("Error make pipe"));
+	// Prepare everything before fork: only async-signal-safe calls in child
+	const string& dir = cfg.filesdir();
+	const char * args[] = {"sh", "-c", cmdline.c_str(), nullptr};
+	rlimit cpu = {cfg.exec_cpu_limit, cfg.exec_cpu_limit + 1UL};
+	rlimit mem = {cfg.exec_memory_limit, cfg.exec_memory_limit};
+	pid_t pid = fork();
+	if (pid == -1) {
+		close(pip[0]);
+		close(pip[1]);
+		throw exc_errno(_("Can't fork"));
+	}
+	if (!pid) {
+		setpgid(0, 0); // to kill program with its children on timeout
+		signal(SIGPIPE, SIG_DFL);
+		if (chdir(dir.c_str()))
+			_exit(126);
+		if (cfg.exec_cpu_limit)
+			setrlimit(RLIMIT_CPU, &cpu);
+		if (cfg.exec_memory_limit)
+			setrlimit(RLIMIT_AS, &mem);
+		if (dup2(pip[1], STDOUT_FILENO) == -1)
+			_exit(126);
+		execv("/bin/sh", (char * const *)args);
+		_exit(127);
+	}
+	close(pip[1]);
+	out = pip[0];
+	fcntl(out, F_SETFL, fcntl(out, F_GETFL) | O_NONBLOCK);
+	pidfd = syscall(SYS_pidfd_open, pid, 0);
+	if (pidfd == -1) {
+		// Old kernel, let caller run program synchronously
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		close(out);
+		return -1;
+	}
+	return pid;
+}
+
+bool ExecSupervisor::start(const MsgId& id, const string& cmdline)
+{
+	lock lk(mtx);
+	if (!active)
+		return false;
+	Child c;
+	c.id = id;
+	c.res.run = true;
+	c.res.cmd = cmdline;
+	c.res.output = Spool(cfg.exec_spool_size, cfg.filesdir());
+	c.pid = spawn(cmdline, c.out, c.pidfd);
+	if (c.pid == -1)
+		return false;
+	c.deadline = cfg.exec_timeout ? time(nullptr) + cfg.exec_timeout : 0;
+	debug << "Started " << c.pid << ": " << cmdline;
+	children.push_back(move(c));
+	wake();
+	return true;
+}
+
+void ExecSupervisor::wake()
+{
+	uint64_t x = 1;
+	if (write(wake_fd, &x, sizeof(x)) < 0)
+		warn << "eventfd: " << strerror(errno);
+}
+
+void ExecSupervisor::read_output(Child& c)
+{
+	char buf[0x1000];
+	for (;;) {
+		ssize_t x = read(c.out, buf, sizeof(buf));
+		if (x > 0) {
+			size_t limit = cfg.exec_output_limit ? cfg.exec_output_limit : -1UL;
+			size_t n = min<size_t>(x, limit - c.res.output.size());
+			c.res.output.append(buf, n);
+			c.dropped += x - n;
+			continue;
+		}
+		if (x < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (x < 0)
+			warn << "Error exec cmd" << ' ' << c.res.cmd;
+		close(c.out);
+		c.out = -1;
+		return;
+	}
+}
+
+void ExecSupervisor::reap(Child& c)
+{
+	if (c.out != -1) {
+		read_output(c); // rest of output, don't wait for programs left in background
+		if (c.out != -1)
+			close(c.out);
+	}
+	close(c.pidfd);
+	int status = -1;
+	while (waitpid(c.pid, &status, 0) == -1 && errno == EINTR);
+	c.res.ok = !status && !c.killed;
+	if (c.dropped) {
+		string note = "\n[" + std::to_string(c.dropped) + " bytes of output dropped]\n";
+		c.res.output.append(note.data(), note.size());
+	}
+	if (c.killed)
+		warn << _("Command timed out") << ' ' << c.res.cmd;
+}
+
+void ExecSupervisor::run(const Callback& finished)
+{
+	while (prog_status == ProgramStatus::work) {
+		vector<pollfd> fds = {{wake_fd, POLLIN, 0}};
+		int timeout = -1;
+		{
+			lock lk(mtx);
+			time_t now = time(nullptr);
+			for (Child& c : children) {
+				fds.push_back({c.pidfd, POLLIN, 0});
+				if (c.out != -1)
+					fds.push_back({c.out, POLLIN, 0});
+				if (c.deadline && !c.killed) {
+					int t = c.deadline > now ? (c.deadline - now) * 1000 : 0;
+					timeout = timeout == -1 ? t : min(timeout, t);
+				}
+			}
+		}
+		if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+			throw exc_errno("poll");
+		if (fds[0].revents & POLLIN) {
+			uint64_t x;
+			if (read(wake_fd, &x, sizeof(x)) < 0 && errno != EAGAIN)
+				warn << "eventfd: " << strerror(errno);
+		}
+
+		list<Child> done;
+		{
+			lock lk(mtx);
+			time_t now = time(nullptr);
+			size_t i = 1;
+			for (auto p = children.begin(); p != children.end();) {
+				Child& c = *p;
+				// Children started after poll() are not in fds
+				bool polled = i < fds.size() && fds[i].fd == c.pidfd;
+				bool exited = polled && fds[i++].revents;
+				if (polled && c.out != -1 && i < fds.size() && fds[i].fd == c.out && fds[i++].revents)
+					read_output(c);
+				if (c.deadline && !c.killed && c.deadline <= now) {
+					kill(-c.pid, SIGKILL);
+					c.killed = true;
+				}
+				if (exited) {
+					reap(c);
+					done.splice(done.end(), children, p++);
+				} else
+					p++;
+			}
+		}
+		for (Child& c : done)
+			finished(c.id, move(c.res));
+	}
+
+	list<Child> left;
+	{
+		lock lk(mtx);
+		active = false;
+		left.swap(children);
+	}
+	for (Child& c : left) {
+		kill(-c.pid, SIGKILL);
+		reap(c);
+		c.res.cancelled = true;
+		finished(c.id, move(c.res));
+	}
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <functional>
+#include <sys/types.h>
+#include "core.h"
+
+/* Runs programs of 'exec' commands without waiting for them.
+ * Children are watched by run() in separate thread with poll() on their
+ * pidfd and output pipe. Program is killed on timeout, output is cut to
+ * limit, CPU time and memory are limited by setrlimit() (see Config) */
+struct ExecSupervisor {
+	ExecSupervisor(const Config&);
+	ExecSupervisor(const ExecSupervisor&) = delete;
+	ExecSupervisor& operator=(const ExecSupervisor&) = delete;
+	~ExecSupervisor();
+
+	typedef std::function<void(const MsgId&, ExecOutput&&)> Callback;
+
+	// Allow start(). It is disallowed again when run() returns
+	void open();
+
+	/* Start program for command. Return false if start is not allowed,
+	 * so program should be run other way */
+	bool start(const MsgId&, const std::string& cmdline);
+
+	/* Watch children while program status is work. Finished is called
+	 * for each finished child (without lock). Children left on exit are
+	 * killed and reported as cancelled */
+	void run(const Callback& finished);
+
+	// Wake run() to check program status or new children
+	void wake();
+private:
+	struct Child {
+		MsgId id;
+		pid_t pid;
+		int pidfd;
+		int out; // read end of output pipe, -1 on EOF
+		time_t deadline;
+		bool killed = false;
+		size_t dropped = 0; // size of output over limit
+		ExecOutput res;
+	};
+
+	// Return -1 if pidfd is not supported
+	pid_t spawn(const std::string& cmdline, int& out, int& pidfd) const;
+	void read_output(Child&);
+	// Collect exit status and close descriptors
+	void reap(Child&);
+
+	const Config& cfg;
+	std::mutex mtx;
+	std::list<Child> children;
+	int wake_fd; // eventfd to wake run() when child started
+	bool active = false;
+};
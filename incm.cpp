@@ -1,9 +1,11 @@
 #include "incm.h"
 #include <libintl.h>
 #include <iostream>
+#include <fstream>
 #include <filesystem>
 #include <algorithm>
 #include "utils.h"
+#include "rowops.h"
 #include "exc_error.h"
 #define _(STRING) gettext(STRING)
 
@@ -20,6 +22,7 @@ using std::sort;
 using std::vector;
 using std::string;
 using std::ostream;
+using std::ofstream;
 
 map<string, void (Core::*)(ostream&, vector<string>&)> incm_list = {
 	{"help", &Core::incm_help},
@@ -51,6 +54,7 @@ map<string, void (Core::*)(ostream&, vector<string>&)> incm_list = {
 	{"write-packet", &Core::incm_write_packet},
 	{"queue", &Core::incm_queue},
 	{"stored-commands", &Core::incm_stored_commands},
+	{"export-state", &Core::incm_export_state},
 	{"exit", nullptr}
 };
 
@@ -104,8 +108,13 @@ void Core::incm_addfile(std::ostream& os, vector<string>& param)
 	if (param.size() > 2)
 		abs_fn /= param[2];
 	abs_fn /= fs::path(param[1]).filename();
-	string rel_fn = abs_fn.lexically_relative(cfg.filesdir());
+	add_file(abs_fn.lexically_relative(cfg.filesdir()));
+	os << _("File added");
+}
 
+void Core::add_file(const string& rel_fn)
+{
+	string abs_fn = cfg.filesdir() + '/' + rel_fn;
 	if (cfg.files_granularity == -1UL)  {
 		Json::Value cmd;
 		cmd["name"] = "addfile";
@@ -131,7 +140,6 @@ void Core::incm_addfile(std::ostream& os, vector<string>& param)
 		cmd["filename"] = rel_fn;
 		create_command(move(cmd));
 	}
-	os << _("File added");
 }
 
 void Core::incm_delfile(std::ostream& os, vector<string>& param)
@@ -200,6 +208,11 @@ void Core::incm_showexec(std::ostream& os, vector<string>& param)
 		if (out.empty() || out.back() != '\n')
 			out += '\n';
 		os << out;
+		if (rec.isMember("output-file")) {
+			os << "-------------------------\n" << _("Full output") << " (";
+			os << rec["output-size"].asUInt64() << "): ";
+			os << cfg.filesdir() << '/' << rec["output-file"].asString() << '\n';
+		}
 	}
 }
 
@@ -350,8 +363,7 @@ void Core::incm_queue(std::ostream& os, vector<string>& param)
 	size_t s = nodes.size();
 	vector<size_t> maxrow(s);
 	for (const auto& n : nodes)
-		for (size_t i = 0; i < s; i++)
-			maxrow[i] = max(maxrow[i], n.second.matrix_row[i]);
+		row_max(maxrow.data(), n.second.matrix_row.data(), s);
 	for (const auto& n : nodes) {
 		size_t d = 0;
 			for (size_t i = 0; i < s; i++)
@@ -407,6 +419,20 @@ void Core::incm_stored_commands(std::ostream& os, vector<string>& param)
 	write_string(json, os);
 }
 
+void Core::incm_export_state(std::ostream& os, vector<string>& param)
+{
+	if (param.size() < 2)
+		return;
+	ofstream f(param[1]);
+	if (!f)
+		throw exc_errno(_("Error open file"), param[1]);
+	write_string(export_state(), f);
+	f.close();
+	if (!f)
+		throw exc_errno(_("Error save file"), param[1]);
+	os << _("State exported");
+}
+
 void Core::incm_help(ostream& os, vector<string>& str)
 {
 	os << _("Available commands") << ":\n";
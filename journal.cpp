@@ -0,0 +1,132 @@
+#include "journal.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libintl.h>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include "utils.h"
+#include "exc_error.h"
+#include "warn.h"
+#define _(STRING) gettext(STRING)
+
+using std::move;
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::istringstream;
+using std::istreambuf_iterator;
+using std::exception;
+
+Journal::~Journal()
+{
+	try {
+		close();
+	} catch (const exception& exc) {
+		warn << exc.what();
+	}
+}
+
+vector<Json::Value> Journal::load(const string& fname, size_t generation)
+{
+	filename = fname;
+	fsize = 0;
+	loaded_generation = 0;
+	vector<Json::Value> res;
+	ifstream f(filename);
+	if (!f)
+		return res;
+	const string data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+	size_t pos = 0;
+	bool first = true;
+	for (;;) {
+		size_t eol = data.find('\n', pos);
+		if (eol == string::npos)
+			break;
+		Json::Value rec;
+		try {
+			istringstream(data.substr(pos, eol - pos)) >> rec;
+		} catch (const exception&) {
+			warn << _("Journal damaged, rest of it is ignored");
+			break;
+		}
+		if (first) {
+			if (!rec["generation"].isUInt64() || rec["generation"].asUInt64() != generation)
+				return res;
+			loaded_generation = generation;
+			first = false;
+		} else
+			res.push_back(move(rec));
+		pos = eol + 1;
+		fsize = pos;
+	}
+	return res;
+}
+
+void Journal::open(const string& fname, size_t generation)
+{
+	if (!fsize || loaded_generation != generation) {
+		reset(fname, generation);
+		return;
+	}
+	close();
+	filename = fname;
+	fd = ::open(filename.c_str(), O_WRONLY);
+	if (fd == -1)
+		throw exc_errno(_("Error open file"), filename);
+	if (ftruncate(fd, fsize))
+		throw exc_errno(_("Error write to"), filename);
+	if (lseek(fd, fsize, SEEK_SET) == -1)
+		throw exc_errno(_("Error write to"), filename);
+}
+
+void Journal::reset(const string& fname, size_t generation)
+{
+	close();
+	filename = fname;
+	fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		throw exc_errno(_("Error create file"), filename);
+	Json::Value rec;
+	rec["generation"] = generation;
+	const string str = compact_string(rec) + '\n';
+	writefile_all(fd, str.data(), str.size(), filename);
+	if (fdatasync(fd))
+		throw exc_errno(_("Error write to"), filename);
+	sync_dir(filename);
+	fsize = str.size();
+	loaded_generation = generation;
+}
+
+void Journal::append(const Json::Value& rec)
+{
+	const string str = compact_string(rec) + '\n';
+	try {
+		writefile_all(fd, str.data(), str.size(), filename);
+		if (fdatasync(fd))
+			throw exc_errno(_("Error write to"), filename);
+	} catch (...) {
+		// Do not leave partial record: records after it would be lost
+		if (ftruncate(fd, fsize) == 0)
+			lseek(fd, fsize, SEEK_SET);
+		throw;
+	}
+	fsize += str.size();
+}
+
+size_t Journal::size() const
+{
+	return fsize;
+}
+
+bool Journal::is_open() const
+{
+	return fd != -1;
+}
+
+void Journal::close()
+{
+	closefile(fd, filename);
+}
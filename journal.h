@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <json/json.h>
+
+/* Append-only journal of node state changes made after last full save
+ * (checkpoint). Each record is a line of compact json. First record contains
+ * only generation number of checkpoint the journal belongs to, so journal
+ * left from older checkpoint is ignored.
+ * Record which is not completely written (program crash) and everything after
+ * it is ignored and cut off on open(). */
+struct Journal {
+	Journal() = default;
+	Journal(const Journal&) = delete;
+	Journal& operator=(const Journal&) = delete;
+	~Journal();
+
+	/* Read records of specified generation (without first one).
+	 * Return empty vector if there is no journal or it belongs to other
+	 * generation */
+	std::vector<Json::Value> load(const std::string& filename, size_t generation);
+
+	/* Open journal to append records. Must be called after load() with the
+	 * same parameters. Start new journal if loaded one is not suitable */
+	void open(const std::string& filename, size_t generation);
+
+	// Start new empty journal for new checkpoint
+	void reset(const std::string& filename, size_t generation);
+
+	// Write record and sync it to disk
+	void append(const Json::Value&);
+
+	// Size of journal file
+	size_t size() const;
+
+	bool is_open() const;
+
+	void close();
+private:
+	std::string filename;
+	int fd = -1;
+	size_t fsize = 0; // size of valid part of journal
+	size_t loaded_generation = 0;
+};
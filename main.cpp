@@ -13,7 +13,7 @@
 #include "utils.h"
 #include "utils_iface.h"
 #include "daemon.h"
-#include "alarmer.h"
+#include "signals.h"
 #ifdef USE_X
 #include "iface_info.h"
 #include "iface_main.h"
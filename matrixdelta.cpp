@@ -0,0 +1,186 @@
+#include "matrixdelta.h"
+#include <libintl.h>
+#include <cstring>
+#include "main.h"
+#include "varint.h"
+#include "rowops.h"
+#include "exc_error.h"
+#define _(STRING) gettext(STRING)
+
+using std::string;
+using std::vector;
+
+MatrixHistory::MatrixHistory()
+{
+	do
+		rnd.read((char *)&epoch, sizeof(epoch));
+	while (!epoch);
+}
+
+void MatrixHistory::refresh(const Matrix& m)
+{
+	const size_t N = m.size();
+	vector<UUID> cur;
+	cur.reserve(N);
+	for (const auto& n : m)
+		cur.push_back(n.first);
+	const uint64_t v = version + 1;
+
+	if (cur != ids) {
+		ids = std::move(cur);
+		cells.clear();
+		cells.reserve(N * N);
+		netmsgcnt.clear();
+		proto_ver.clear();
+		for (const auto& n : m) {
+			cells.insert(cells.end(), n.second.matrix_row.begin(), n.second.matrix_row.end());
+			netmsgcnt.push_back(n.second.netmsgcnt);
+			proto_ver.push_back(n.second.proto_ver);
+		}
+		cell_ver.assign(N * N, v);
+		row_ver.assign(N, v);
+		version = layout_version = v;
+		return;
+	}
+
+	bool changed = false;
+	size_t i = 0;
+	for (const auto& n : m) {
+		const size_t * row = n.second.matrix_row.data();
+		size_t * snap = &cells[i * N];
+		if (!row_equal(row, snap, N)) {
+			for (size_t j = 0; j < N; j++)
+				if (row[j] != snap[j]) {
+					snap[j] = row[j];
+					cell_ver[i * N + j] = v;
+				}
+			changed = true;
+		}
+		if (netmsgcnt[i] != n.second.netmsgcnt || proto_ver[i] != n.second.proto_ver) {
+			netmsgcnt[i] = n.second.netmsgcnt;
+			proto_ver[i] = n.second.proto_ver;
+			row_ver[i] = v;
+			changed = true;
+		}
+		i++;
+	}
+	if (changed)
+		version = v;
+}
+
+/* Format (numbers are varints):
+ * epoch (8 bytes), version, full flag (byte), if full: N and N UUIDs,
+ * number of rows, for each row: node index gap, netmsgcnt, proto_ver, number
+ * of cells C, C pairs (column gap, value) or N values if C == N.
+ * Gap is difference with previous index minus 1 */
+string MatrixHistory::encode(const Matrix& m, uint64_t ep, uint64_t since)
+{
+	refresh(m);
+	const size_t N = ids.size();
+	const bool full = ep != epoch || !since || since < layout_version || since > version;
+	if (full)
+		since = 0;
+
+	string res;
+	res.append((const char *)&epoch, sizeof(epoch));
+	put_varint(res, version);
+	res += char(full);
+	if (full) {
+		put_varint(res, N);
+		res.append((const char *)ids.data(), N * sizeof(UUID));
+	}
+
+	vector<size_t> rows;
+	for (size_t i = 0; i < N; i++) {
+		bool changed = row_ver[i] > since;
+		for (size_t j = 0; !changed && j < N; j++)
+			changed = cell_ver[i * N + j] > since;
+		if (changed)
+			rows.push_back(i);
+	}
+	put_varint(res, rows.size());
+	size_t prev_row = -1UL;
+	for (size_t i : rows) {
+		put_varint(res, i - prev_row - 1);
+		prev_row = i;
+		put_varint(res, netmsgcnt[i]);
+		put_varint(res, proto_ver[i]);
+		const uint64_t * ver = &cell_ver[i * N];
+		const size_t * row = &cells[i * N];
+		size_t C = 0;
+		for (size_t j = 0; j < N; j++)
+			C += ver[j] > since;
+		put_varint(res, C);
+		size_t prev = -1UL;
+		for (size_t j = 0; j < N; j++)
+			if (ver[j] > since) {
+				if (C != N)
+					put_varint(res, j - prev - 1);
+				prev = j;
+				put_varint(res, row[j]);
+			}
+	}
+	return res;
+}
+
+MatrixDelta MatrixDelta::decode(const string& data, MatrixBase& base)
+{
+	const char * p = data.data();
+	const char * end = p + data.size();
+	uint64_t epoch;
+	if (data.size() < sizeof(epoch))
+		throw exc_error(_("Bad matrix"));
+	memcpy(&epoch, p, sizeof(epoch));
+	p += sizeof(epoch);
+	uint64_t version = get_varint(p, end);
+	if (p == end)
+		throw exc_error(_("Bad matrix"));
+	bool full = *p++;
+
+	MatrixDelta res;
+	res.full = full;
+	if (full) {
+		size_t N = get_varint(p, end);
+		if (N > size_t(end - p) / sizeof(UUID))
+			throw exc_error(_("Bad matrix"));
+		auto ids = std::make_shared<vector<UUID>>(N);
+		memcpy(ids->data(), p, N * sizeof(UUID));
+		p += N * sizeof(UUID);
+		res.ids = ids;
+	} else if (base.ids && base.epoch == epoch)
+		res.ids = base.ids;
+	else
+		throw exc_error(_("Bad matrix"));
+
+	const size_t N = res.ids->size();
+	size_t R = get_varint(p, end);
+	if (R > N)
+		throw exc_error(_("Bad matrix"));
+	res.rows.resize(R);
+	size_t node = -1UL;
+	for (Row& r : res.rows) {
+		node += get_varint(p, end) + 1;
+		r.node = node;
+		r.netmsgcnt = get_varint(p, end);
+		r.proto_ver = get_varint(p, end);
+		size_t C = get_varint(p, end);
+		if (node >= N || C > N)
+			throw exc_error(_("Bad matrix"));
+		r.cells.resize(C);
+		size_t col = -1UL;
+		for (auto& c : r.cells) {
+			col += C == N ? 1 : get_varint(p, end) + 1;
+			if (col >= N)
+				throw exc_error(_("Bad matrix"));
+			c.first = col;
+			c.second = get_varint(p, end);
+		}
+	}
+	if (p != end)
+		throw exc_error(_("Bad matrix"));
+
+	base.epoch = epoch;
+	base.version = version;
+	base.ids = res.ids;
+	return res;
+}
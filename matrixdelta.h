@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "core.h"
+
+/* Matrix exchange in TCP sessions (protocol 2). Receiver tells version of
+ * sender's matrix it has got last time, sender writes only cells changed
+ * since that version. Whole matrix is written if version is unknown (first
+ * session, restart of sender) or nodes were added or deleted since.
+ * Cells are merged by max(), so changes are enough to get the same result
+ * as merge of whole matrix. */
+
+// Changes of matrix of this node, made to be sent to other nodes
+struct MatrixHistory {
+	MatrixHistory();
+
+	/* Encode matrix for node which has got 'version' of it before
+	 * (0 - nothing). Changes since previous call are found first */
+	std::string encode(const Matrix&, uint64_t epoch, uint64_t version);
+private:
+	void refresh(const Matrix&);
+
+	uint64_t epoch; // random, so versions before restart are not used
+	uint64_t version = 0;
+	uint64_t layout_version = 0; // when nodes were changed
+	std::vector<UUID> ids;
+	std::vector<size_t> cells; // copy of matrix, N x N
+	std::vector<uint64_t> cell_ver; // version when cell was changed
+	std::vector<size_t> netmsgcnt;
+	std::vector<short> proto_ver;
+	std::vector<uint64_t> row_ver; // version when netmsgcnt or proto_ver changed
+};
+
+// Last matrix got from other node
+struct MatrixBase {
+	uint64_t epoch = 0;
+	uint64_t version = 0;
+	std::shared_ptr<const std::vector<UUID>> ids; // nodes of sender
+};
+
+// Changed cells of other node's matrix. See MatrixHistory::encode()
+struct MatrixDelta {
+	struct Row {
+		size_t node; // index in ids
+		size_t netmsgcnt;
+		short proto_ver;
+		std::vector<std::pair<size_t, size_t>> cells; // column, value
+	};
+
+	// Decode data and update base. Throw exc_error if data doesn't fit to base
+	static MatrixDelta decode(const std::string&, MatrixBase&);
+
+	std::shared_ptr<const std::vector<UUID>> ids;
+	std::vector<Row> rows;
+	bool full = false; // whole matrix is written
+};
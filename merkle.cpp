@@ -0,0 +1,53 @@
+#include "merkle.h"
+
+const SHA256& RowTree::update(const Matrix& m, const Node& node)
+{
+	const size_t N = m.size();
+	const size_t * row = node.matrix_row.data();
+	bool same = N == ids.size();
+	auto id = ids.begin();
+	for (auto n = m.begin(); same && n != m.end(); n++, id++)
+		same = n->first == *id;
+
+	if (!same) {
+		ids.clear();
+		ids.reserve(N);
+		for (const auto& n : m)
+			ids.push_back(n.first);
+		values.assign(row, row + N);
+		for (leaves = 1; leaves < N; leaves *= 2);
+		tree.assign(leaves * 2, SHA256());
+		for (size_t i = 0; i < N; i++)
+			hash_leaf(i);
+		for (size_t i = leaves - 1; i; i--)
+			hash_inner(i);
+		return tree[1];
+	}
+
+	for (size_t j = 0; j < N; j++)
+		if (row[j] != values[j]) {
+			values[j] = row[j];
+			hash_leaf(j);
+			for (size_t i = (leaves + j) / 2; i; i /= 2)
+				hash_inner(i);
+		}
+	return tree[1];
+}
+
+void RowTree::hash_leaf(size_t i)
+{
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, (const uint8_t *)&ids[i], sizeof(UUID));
+	SHA256_Update(&ctx, (const uint8_t *)&values[i], sizeof(size_t));
+	SHA256_Final(tree[leaves + i].hash, &ctx);
+}
+
+void RowTree::hash_inner(size_t i)
+{
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, tree[i * 2].hash, sizeof(SHA256::hash));
+	SHA256_Update(&ctx, tree[i * 2 + 1].hash, sizeof(SHA256::hash));
+	SHA256_Final(tree[i].hash, &ctx);
+}
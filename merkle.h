@@ -0,0 +1,21 @@
+#pragma once
+#include <vector>
+#include "core.h"
+
+/* Merkle tree over cells of row of matrix. Leaf is hash of author node and
+ * number of its commands known, inner node is hash of its children. So root
+ * is the same for nodes which know the same commands, and change of cell
+ * costs O(log N) hashes */
+struct RowTree {
+	// Update tree for row of node of matrix and return root
+	const SHA256& update(const Matrix&, const Node&);
+private:
+	void hash_leaf(size_t i);
+	void hash_inner(size_t i);
+
+	std::vector<UUID> ids;
+	std::vector<size_t> values;
+	// tree[1] is root, children of tree[i] are tree[2i] and tree[2i+1]
+	std::vector<SHA256> tree;
+	size_t leaves = 0; // offset of first leaf, power of 2
+};
@@ -0,0 +1,166 @@
+#include "msglog.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <libintl.h>
+#include <filesystem>
+#include "utils.h"
+#include "exc_error.h"
+#define _(STRING) gettext(STRING)
+
+namespace fs = std::filesystem;
+using std::string;
+using std::to_string;
+using std::exception;
+using std::move;
+using std::vector;
+
+bool MsgLocation::stored() const
+{
+	return segment != -1UL;
+}
+
+void MsgLog::open(const string& d)
+{
+	if (dir == d)
+		return;
+	authors.clear();
+	dir = d;
+	fs::create_directories(dir);
+	for (const auto& adir : fs::directory_iterator(dir)) {
+		UUID id = adir.path().filename().string();
+		if (!id || !adir.is_directory())
+			continue;
+		Author& a = authors[id];
+		for (const auto& seg : fs::directory_iterator(adir.path()))
+			try {
+				a.refs[std::stoull(seg.path().filename().string())];
+			} catch (const exception&) {}
+	}
+}
+
+string MsgLog::segment_name(const UUID& author, uint64_t segment) const
+{
+	return dir + '/' + string(author) + '/' + to_string(segment);
+}
+
+MsgLocation MsgLog::append(const UUID& author, const string& body)
+{
+	Author& a = authors[author];
+	if (a.appending && a.last_size >= segment_size) {
+		a.last++;
+		a.last_size = 0;
+	} else if (!a.appending) {
+		a.last = a.refs.empty() ? 0 : a.refs.rbegin()->first;
+		std::error_code ec;
+		a.last_size = fs::file_size(segment_name(author, a.last), ec);
+		if (ec)
+			a.last_size = 0;
+		else if (a.last_size >= segment_size) {
+			a.last++;
+			a.last_size = 0;
+		}
+	}
+	const string filename = segment_name(author, a.last);
+	if (!a.appending) {
+		fs::create_directories(dir + '/' + string(author));
+		a.appending = true;
+	}
+	if (writes.empty() || writes.back().filename != filename)
+		writes.push_back({filename, string(), !fs::exists(filename)});
+	writes.back().data += body;
+	writes.back().data += '\n';
+	MsgLocation res;
+	res.segment = a.last;
+	res.offset = a.last_size;
+	res.size = body.size();
+	a.last_size += body.size() + 1;
+	a.refs[a.last]++;
+	return res;
+}
+
+vector<MsgLog::Write> MsgLog::take_writes()
+{
+	vector<Write> res = move(writes);
+	writes.clear();
+	return res;
+}
+
+void MsgLog::write(const vector<Write>& writes)
+{
+	for (const Write& w : writes) {
+		int fd = ::open(w.filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+		if (fd == -1)
+			throw exc_errno(_("Error open file"), w.filename);
+		try {
+			writefile_all(fd, w.data.data(), w.data.size(), w.filename);
+			if (fdatasync(fd))
+				throw exc_errno(_("Error write to"), w.filename);
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		closefile(fd, w.filename);
+		if (w.new_file)
+			sync_dir(w.filename);
+	}
+}
+
+void MsgLog::close_appends()
+{
+	writes.clear();
+	for (auto& a : authors)
+		a.second.appending = false;
+}
+
+string MsgLog::read(const UUID& author, const MsgLocation& loc) const
+{
+	const string filename = segment_name(author, loc.segment);
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		throw exc_errno(_("Error open file"), filename);
+	string res(loc.size, '\0');
+	ssize_t x = pread(fd, res.data(), loc.size, loc.offset);
+	::close(fd);
+	if (x != (ssize_t)loc.size)
+		throw exc_error(_("Error read file"), filename);
+	return res;
+}
+
+void MsgLog::ref(const UUID& author, const MsgLocation& loc)
+{
+	authors[author].refs[loc.segment]++;
+}
+
+void MsgLog::unref(const UUID& author, const MsgLocation& loc)
+{
+	auto a = authors.find(author);
+	if (a == authors.end())
+		return;
+	auto p = a->second.refs.find(loc.segment);
+	if (p != a->second.refs.end() && p->second)
+		p->second--;
+}
+
+void MsgLog::collect()
+{
+	for (auto a = authors.begin(); a != authors.end();) {
+		auto& refs = a->second.refs;
+		for (auto s = refs.begin(); s != refs.end();) {
+			if (s->second) {
+				s++;
+				continue;
+			}
+			if (a->second.last == s->first)
+				a->second.appending = false;
+			fs::remove(segment_name(a->first, s->first));
+			s = refs.erase(s);
+		}
+		if (refs.empty()) {
+			std::error_code ec;
+			fs::remove(dir + '/' + string(a->first), ec);
+			a = authors.erase(a);
+		} else
+			a++;
+	}
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include "uuid.h"
+
+// Place of command body in segment file
+struct MsgLocation {
+	bool stored() const;
+
+	uint64_t segment = -1UL; // number of segment file of command author, -1 if not stored yet
+	uint64_t offset = 0;
+	uint64_t size = 0;
+};
+
+/* Command bodies stored in segment files DIR/<author uuid>/<segment number>.
+ * Bodies of each author are appended to his last segment, new segment
+ * is started when last one grows larger than segment_size.
+ * Segment is removed as a whole when there is no live command in it.
+ * Which commands are alive is known from index (node file and journal),
+ * segment file itself is only storage for bodies. */
+struct MsgLog {
+	MsgLog() = default;
+	MsgLog(const MsgLog&) = delete;
+	MsgLog& operator=(const MsgLog&) = delete;
+
+	// Find existing segments. Does nothing if already opened with the same directory
+	void open(const std::string& dir);
+
+	/* Data to append to segment file. File is opened by write(), so segments
+	 * started while data of previous ones is pending don't affect it */
+	struct Write {
+		std::string filename;
+		std::string data;
+		bool new_file; // directory entry should be synced too
+	};
+
+	/* Place body to last segment of author. Location is referenced (see ref()).
+	 * Data is not written untill write() is called with take_writes() result */
+	MsgLocation append(const UUID& author, const std::string& body);
+
+	// Return data prepared by append() since last call
+	std::vector<Write> take_writes();
+
+	/* Write data to segment files and sync them. Uses nothing but parameter,
+	 * so it may be called without lock while message log is used */
+	static void write(const std::vector<Write>&);
+
+	// Forget segments opened to append. Used when write() failed
+	void close_appends();
+
+	std::string read(const UUID& author, const MsgLocation&) const;
+
+	// Count live commands in segments
+	void ref(const UUID& author, const MsgLocation&);
+	void unref(const UUID& author, const MsgLocation&);
+
+	/* Remove segments without live commands. Must be called when removal of
+	 * commands is already saved to node file or journal */
+	void collect();
+private:
+	struct Author {
+		std::map<uint64_t, size_t> refs; // segment number -> count of live commands
+		bool appending = false; // size of last segment is known
+		uint64_t last = 0;
+		uint64_t last_size = 0;
+	};
+
+	std::string segment_name(const UUID& author, uint64_t segment) const;
+
+	std::string dir;
+	std::map<UUID, Author> authors;
+	std::vector<Write> writes;
+	const size_t segment_size = 0x100000;
+};
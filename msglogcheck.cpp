@@ -0,0 +1,90 @@
+/* Check of message log: bodies of one save batch which cross segment
+ * boundaries (several segments of one author, authors interleaved) are read
+ * back from their locations, also after log is opened again.
+ * Build and run: make check */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <json/json.h>
+#include "msglog.h"
+#include "tmpdir.h"
+#include "main.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::exception;
+
+ProgramStatus prog_status = ProgramStatus::work;
+ifstream rnd("/dev/urandom");
+Json::StreamWriterBuilder json_builder;
+Json::StreamWriterBuilder json_cbuilder;
+std::random_device rd;
+
+struct Body {
+	UUID author;
+	string data;
+	MsgLocation loc;
+};
+
+// Return count of bodies which differ from stored ones
+static size_t check(const MsgLog& log, const vector<Body>& bodies)
+{
+	size_t bad = 0;
+	for (const Body& b : bodies)
+		try {
+			if (log.read(b.author, b.loc) != b.data)
+				bad++;
+		} catch (const exception& exc) {
+			cerr << exc.what() << endl;
+			bad++;
+		}
+	return bad;
+}
+
+// Append count bodies of size bytes by turns of authors and write them as one batch
+static void batch(MsgLog& log, const vector<UUID>& authors, size_t count, size_t size, vector<Body>& bodies)
+{
+	for (size_t i = 0; i < count; i++) {
+		Body b;
+		b.author = authors[i % authors.size()];
+		b.data = string(size, char('a' + bodies.size() % 26));
+		b.loc = log.append(b.author, b.data);
+		bodies.push_back(b);
+	}
+	MsgLog::write(log.take_writes());
+}
+
+int main()
+{
+	TmpDir tmp("/tmp/msglogcheck");
+	vector<UUID> authors(2);
+	for (UUID& a : authors)
+		a.random(rnd);
+	vector<Body> bodies;
+	size_t bad = 0;
+	try {
+		{
+			MsgLog log;
+			log.open(tmp.path);
+			batch(log, {authors[0]}, 30, 100000, bodies); // 3 segments in one batch
+			batch(log, authors, 40, 60000, bodies); // authors interleaved
+			bad += check(log, bodies);
+		}
+		MsgLog log;
+		log.open(tmp.path);
+		for (const Body& b : bodies)
+			log.ref(b.author, b.loc);
+		batch(log, authors, 40, 60000, bodies); // continue segments left by previous run
+		bad += check(log, bodies);
+	} catch (const exception& exc) {
+		cerr << exc.what() << endl;
+		return 1;
+	}
+	cout << bodies.size() << " bodies, " << bad << " bad" << endl;
+	return bad ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+/* Lookup, insert and collection of commands in MsgStore and in nested maps
+ * author -> number -> command, which MsgStore used before deques.
+ * Commands are inserted by rounds of all authors, looked up by random ids,
+ * then older half of commands of each author is collected.
+ * Build: make msgstorebench. Run: ./msgstorebench [authors] [commands of author] */
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include <json/json.h>
+#include "core.h"
+#include "main.h"
+
+using std::cout;
+using std::endl;
+using std::map;
+using std::string;
+using std::vector;
+using std::ifstream;
+typedef std::chrono::steady_clock Clock;
+
+ProgramStatus prog_status = ProgramStatus::work;
+ifstream rnd("/dev/urandom");
+Json::StreamWriterBuilder json_builder;
+Json::StreamWriterBuilder json_cbuilder;
+std::random_device rd;
+
+static const size_t lookup_rounds = 10;
+
+static double seconds_since(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static Msg command(const UUID& author, size_t number)
+{
+	Msg m(author, number);
+	m.set_name("exec");
+	return m;
+}
+
+// Store as it was before: sorted maps of authors and of their commands
+struct MapStore {
+	void insert(Msg&& m)
+	{
+		msgs[m.node_id].emplace(m.msg_number, std::move(m));
+	}
+
+	const Msg * find(const MsgId& id) const
+	{
+		auto a = msgs.find(id.node_id);
+		if (a == msgs.end())
+			return nullptr;
+		auto m = a->second.find(id.msg_number);
+		return m == a->second.end() ? nullptr : &m->second;
+	}
+
+	void truncate(const UUID& author, size_t number)
+	{
+		auto a = msgs.find(author);
+		if (a != msgs.end())
+			a->second.erase(a->second.begin(), a->second.lower_bound(number));
+	}
+
+	map<UUID, map<size_t, Msg>> msgs;
+};
+
+// MsgStore with interface of MapStore
+struct DequeStore {
+	void insert(Msg&& m)
+	{
+		store.insert(std::move(m));
+	}
+
+	const Msg * find(const MsgId& id) const
+	{
+		return store.find(id);
+	}
+
+	void truncate(const UUID& author, size_t number)
+	{
+		store.truncate(author, number, [](const Msg&) {});
+	}
+
+	MsgStore store;
+};
+
+struct Times {
+	double insert, lookup, gc;
+	size_t found;
+};
+
+template <typename Store>
+static Times bench(Store& store, const vector<UUID>& ids, size_t per_author, const vector<MsgId>& lookups)
+{
+	Times res;
+	Clock::time_point start = Clock::now();
+	for (size_t n = 0; n < per_author; n++)
+		for (const UUID& id : ids)
+			store.insert(command(id, n));
+	res.insert = seconds_since(start);
+
+	res.found = 0;
+	start = Clock::now();
+	for (size_t r = 0; r < lookup_rounds; r++)
+		for (const MsgId& id : lookups)
+			res.found += store.find(id) != nullptr;
+	res.lookup = seconds_since(start);
+
+	start = Clock::now();
+	for (const UUID& id : ids)
+		store.truncate(id, per_author / 2);
+	res.gc = seconds_since(start);
+	return res;
+}
+
+static void print(const char * name, const Times& t, size_t inserted, size_t looked_up)
+{
+	cout << name << ": insert " << t.insert / inserted * 1e9 << " ns, lookup " <<
+		t.lookup / looked_up * 1e9 << " ns, gc " << t.gc * 1e3 << " ms (" <<
+		t.found << " found)" << endl;
+}
+
+int main(int argc, char ** argv)
+{
+	size_t authors = argc > 1 ? std::stoul(argv[1]) : 1000;
+	size_t per_author = argc > 2 ? std::stoul(argv[2]) : 100;
+	vector<UUID> ids(authors);
+	for (UUID& id : ids)
+		id.random(rnd);
+	// Every second id is absent: its number is beyond stored ones
+	vector<MsgId> lookups;
+	std::mt19937_64 gen(rd());
+	for (size_t i = 0; i < authors * per_author; i++)
+		lookups.emplace_back(ids[gen() % authors], gen() % (per_author * 2));
+	cout.precision(1);
+	cout << std::fixed;
+
+	MapStore maps;
+	Times t = bench(maps, ids, per_author, lookups);
+	print("maps    ", t, authors * per_author, lookups.size() * lookup_rounds);
+
+	DequeStore deques;
+	t = bench(deques, ids, per_author, lookups);
+	print("MsgStore", t, authors * per_author, lookups.size() * lookup_rounds);
+	return 0;
+}
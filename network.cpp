@@ -6,6 +6,7 @@
 #include <bsd/string.h>
 #include <sys/un.h>
 #include <sys/stat.h>
+#include <netinet/tcp.h>
 #include <gnutls/crypto.h>
 #include "exc_error.h"
 #include "network.h"
@@ -183,6 +184,9 @@ void UDPcrypted::encrypt(const CryptKey& key)
 	case 1:
 		SHA1::write(msg.v1, &UDPmessage_v1::hash);
 		break;
+	case 2:
+		SHA1::write(msg.v2, &UDPmessage_v2::hash);
+		break;
 	default:
 		error(1, 0, "Bad UDP message version");
 	}
@@ -198,6 +202,10 @@ void UDPcrypted::decrypt(const CryptKey& key)
 		if (!SHA1::check(msg.v1, &UDPmessage_v1::hash))
 			msg.base.version = -1;
 		break;
+	case 2:
+		if (!SHA1::check(msg.v2, &UDPmessage_v2::hash))
+			msg.base.version = -1;
+		break;
 	default:
 		msg.base.version = -1;
 	}
@@ -205,15 +213,24 @@ void UDPcrypted::decrypt(const CryptKey& key)
 
 // ===== TCPconn =====
 
+/* Session data is collected by Ostream and written when remote side waits
+ * for it (OCCstream::flush_net), so Nagle's algorithm could only delay it */
+static int nodelay(int fd)
+{
+	int on = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	return fd;
+}
+
 TCPconn::TCPconn(const IN6ad& ad, int port) :
-	fs(connect_to(ad, port), ad.name(), true),
+	fs(nodelay(connect_to(ad, port)), ad.name(), true),
 	fin(fs),
 	fout(fs)
 {
 }
 
 TCPconn::TCPconn(int fd, const string& name) :
-	fs(fd, name, true),
+	fs(nodelay(fd), name, true),
 	fin(fs),
 	fout(fs)
 {
@@ -93,9 +93,26 @@ struct UDPmessage_v1 : UDPmessageBase {
 	SHA1 hash;
 };
 
+// UDP message of protocol 5 and later, has root of tree of commands known
+struct UDPmessage_v2 : UDPmessageBase {
+	UDPmessage_v1::Command message;
+	size_t counter;
+	UUID group_id;
+	UUID node_id;
+	SHA256 node_hash;
+
+	/* Root of Merkle tree over row of node (see RowTree). If nodes have
+	 * the same hash, they have the same commands and differ in matrix only */
+	SHA256 row_hash;
+
+	// Hash of this message
+	SHA1 hash;
+};
+
 union UDPmessage {
 	UDPmessageBase base;
 	UDPmessage_v1 v1;
+	UDPmessage_v2 v2;
 };
 
 // Crypted UDP message
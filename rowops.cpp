@@ -0,0 +1,92 @@
+#include "rowops.h"
+#include <cstring>
+#include <cstdint>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static bool row_max_scalar(size_t * dst, const size_t * src, size_t n)
+{
+	bool changed = false;
+	for (size_t i = 0; i < n; i++)
+		if (dst[i] < src[i]) {
+			dst[i] = src[i];
+			changed = true;
+		}
+	return changed;
+}
+
+static void row_min_scalar(size_t * dst, const size_t * src, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		if (src[i] < dst[i])
+			dst[i] = src[i];
+}
+
+#if defined(__x86_64__)
+/* AVX2 has only signed 64-bit compare, so values are compared with sign
+ * bits flipped */
+
+__attribute__((target("avx2")))
+static bool row_max_avx2(size_t * dst, const size_t * src, size_t n)
+{
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	__m256i changed = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i gt = _mm256_cmpgt_epi64(_mm256_xor_si256(b, sign), _mm256_xor_si256(a, sign));
+		changed = _mm256_or_si256(changed, gt);
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(a, b, gt));
+	}
+	bool res = !_mm256_testz_si256(changed, changed);
+	return row_max_scalar(dst + i, src + i, n - i) || res;
+}
+
+__attribute__((target("avx2")))
+static void row_min_avx2(size_t * dst, const size_t * src, size_t n)
+{
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i gt = _mm256_cmpgt_epi64(_mm256_xor_si256(a, sign), _mm256_xor_si256(b, sign));
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_blendv_epi8(a, b, gt));
+	}
+	row_min_scalar(dst + i, src + i, n - i);
+}
+
+static bool detect_avx2()
+{
+	__builtin_cpu_init(); // may be called before constructors of libgcc
+	return __builtin_cpu_supports("avx2");
+}
+
+static const bool has_avx2 = detect_avx2();
+#endif
+
+bool row_max(size_t * dst, const size_t * src, size_t n)
+{
+#if defined(__x86_64__)
+	if (has_avx2)
+		return row_max_avx2(dst, src, n);
+#endif
+	return row_max_scalar(dst, src, n);
+}
+
+void row_min(size_t * dst, const size_t * src, size_t n)
+{
+#if defined(__x86_64__)
+	if (has_avx2)
+		return row_min_avx2(dst, src, n);
+#endif
+	row_min_scalar(dst, src, n);
+}
+
+bool row_equal(const size_t * a, const size_t * b, size_t n)
+{
+	// memcmp is vectorized by libc already
+	return !memcmp(a, b, n * sizeof(size_t));
+}
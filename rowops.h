@@ -0,0 +1,13 @@
+#pragma once
+#include <cstddef>
+
+/* Element-wise operations on rows of Matrix. Use AVX2 if processor
+ * supports it, scalar code otherwise */
+
+// dst[i] = max(dst[i], src[i]). Return true if dst is changed
+bool row_max(size_t * dst, const size_t * src, size_t n);
+
+// dst[i] = min(dst[i], src[i])
+void row_min(size_t * dst, const size_t * src, size_t n);
+
+bool row_equal(const size_t *, const size_t *, size_t n);
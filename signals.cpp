@@ -0,0 +1,28 @@
+#include "signals.h"
+#include <signal.h>
+#include <cstring>
+#include "main.h"
+#include "core.h"
+
+static void sighandler(int signum)
+{
+	// Core::notify() should be async-signal-safe
+	if (signum == SIGTERM) {
+		prog_status = ProgramStatus::exit;
+		core->notify();
+	} else if (signum == SIGHUP) {
+		prog_status = ProgramStatus::reload;
+		core->notify();
+	}
+}
+
+void init_signals()
+{
+	struct sigaction sact;
+	memset(&sact, 0, sizeof(sact));
+	sact.sa_handler = sighandler;
+	sigaction(SIGHUP, &sact, NULL);
+	sigaction(SIGINT, &sact, NULL);
+	sigaction(SIGTERM, &sact, NULL);
+	signal(SIGPIPE, SIG_IGN);
+}
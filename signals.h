@@ -0,0 +1,5 @@
+#pragma once
+
+/* Set signal handlers: SIGTERM - exit, SIGHUP - reload, SIGINT is ignored.
+ * Should be called at program startup */
+void init_signals();
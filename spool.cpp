@@ -0,0 +1,97 @@
+#include "spool.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <libintl.h>
+#include <algorithm>
+#include "utils.h"
+#include "exc_error.h"
+#define _(STRING) gettext(STRING)
+
+using std::min;
+using std::swap;
+using std::string;
+
+Spool::Spool(size_t t, const string& d) : threshold(t), dir(d)
+{
+}
+
+Spool::Spool(Spool&& src) : threshold(src.threshold), dir(src.dir)
+{
+	swap(mem, src.mem);
+	swap(fd, src.fd);
+	swap(fsize, src.fsize);
+}
+
+Spool& Spool::operator=(Spool&& src)
+{
+	threshold = src.threshold;
+	dir = src.dir;
+	swap(mem, src.mem);
+	swap(fd, src.fd);
+	swap(fsize, src.fsize);
+	return *this;
+}
+
+Spool::~Spool()
+{
+	if (fd != -1)
+		close(fd);
+}
+
+void Spool::append(const char * buf, size_t size)
+{
+	if (fd == -1 && mem.size() + size <= threshold) {
+		mem.append(buf, size);
+		return;
+	}
+	if (fd == -1) {
+		fd = open(dir.c_str(), O_RDWR | O_TMPFILE | O_CLOEXEC, 0600);
+		if (fd == -1)
+			throw exc_errno(_("Error create file"), dir);
+		writefile_all(fd, mem.data(), mem.size(), dir);
+		fsize = mem.size();
+		mem = string();
+	}
+	writefile_all(fd, buf, size, dir);
+	fsize += size;
+}
+
+size_t Spool::size() const
+{
+	return fd == -1 ? mem.size() : fsize;
+}
+
+string Spool::head(size_t size) const
+{
+	if (fd == -1)
+		return mem.substr(0, size);
+	string res(min(size, fsize), '\0');
+	if (pread(fd, res.data(), res.size(), 0) != (ssize_t)res.size())
+		throw exc_errno(_("Error read file"), dir);
+	return res;
+}
+
+void Spool::save(const string& filename) const
+{
+	int out = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (out == -1)
+		throw exc_errno(_("Error create file"), filename);
+	try {
+		if (fd == -1)
+			writefile_all(out, mem.data(), mem.size(), filename);
+		else {
+			char buf[0x10000];
+			for (size_t off = 0; off < fsize;) {
+				ssize_t x = pread(fd, buf, min(sizeof(buf), fsize - off), off);
+				if (x <= 0)
+					throw exc_errno(_("Error read file"), dir);
+				writefile_all(out, buf, x, filename);
+				off += x;
+			}
+		}
+	} catch (...) {
+		close(out);
+		throw;
+	}
+	closefile(out, filename);
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+
+/* Data (program output) kept in memory until it grows larger than
+ * threshold, then moved to unnamed temporary file in specified directory */
+struct Spool {
+	Spool(size_t threshold = -1UL, const std::string& dir = "");
+	Spool(const Spool&) = delete;
+	Spool& operator=(const Spool&) = delete;
+	Spool(Spool&&);
+	Spool& operator=(Spool&&);
+	~Spool();
+
+	void append(const char *, size_t);
+	size_t size() const;
+
+	// Return first bytes of data
+	std::string head(size_t size) const;
+
+	// Store data to file, file is replaced
+	void save(const std::string& filename) const;
+private:
+	size_t threshold;
+	std::string dir;
+	std::string mem;
+	int fd = -1;
+	size_t fsize = 0;
+};
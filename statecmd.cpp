@@ -0,0 +1,77 @@
+#include "statecmd.h"
+
+using std::string;
+
+static string str(const Json::Value& v)
+{
+	return v.isString() ? v.asString() : string();
+}
+
+StateCmdId state_cmd_id(const string& name)
+{
+	switch (name.size()) {
+	case 5:
+		if (name == "smart")
+			return StateCmdId::smart;
+		break;
+	case 6:
+		if (name == "online")
+			return StateCmdId::online;
+		break;
+	case 9:
+		if (name == "antivirus")
+			return StateCmdId::antivirus;
+		break;
+	case 11:
+		if (name == "sethostname")
+			return StateCmdId::sethostname;
+		break;
+	}
+	return StateCmdId::none;
+}
+
+StateCmd state_cmd(const Json::Value& v)
+{
+	switch (state_cmd_id(str(v["name"]))) {
+	case StateCmdId::online:
+		return OnlineCmd{str(v["val"])};
+	case StateCmdId::antivirus:
+		return AntivirusCmd{str(v["updated"]), str(v["scanned"]), v["found"] == true};
+	case StateCmdId::smart:
+		return SmartCmd{v["status"] != false};
+	case StateCmdId::sethostname:
+		return HostnameCmd{str(v["val"])};
+	default:
+		return StateCmd();
+	}
+}
+
+Json::Value state_cmd_json(const StateCmd& cmd)
+{
+	Json::Value res;
+	switch (state_cmd_id(cmd)) {
+	case StateCmdId::online:
+		res["name"] = "online";
+		res["val"] = std::get<OnlineCmd>(cmd).date;
+		break;
+	case StateCmdId::antivirus: {
+		const AntivirusCmd& c = std::get<AntivirusCmd>(cmd);
+		res["name"] = "antivirus";
+		res["updated"] = c.updated;
+		res["scanned"] = c.scanned;
+		res["found"] = c.found;
+		break;
+	}
+	case StateCmdId::smart:
+		res["name"] = "smart";
+		res["status"] = std::get<SmartCmd>(cmd).ok;
+		break;
+	case StateCmdId::sethostname:
+		res["name"] = "sethostname";
+		res["val"] = std::get<HostnameCmd>(cmd).hostname;
+		break;
+	default:
+		break;
+	}
+	return res;
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <string>
+#include <variant>
+#include <json/value.h>
+
+/* Typed form of frequent commands which only report node state
+ * ('online', 'antivirus', 'smart', 'sethostname'). Commands are still spread
+ * as json, typed record is made once per command and kept in memory */
+
+enum class StateCmdId : unsigned char {
+	none, // not a state command
+	online,
+	antivirus,
+	smart,
+	sethostname
+};
+
+struct OnlineCmd {
+	std::string date;
+};
+
+struct AntivirusCmd {
+	std::string updated;
+	std::string scanned;
+	bool found = false;
+};
+
+struct SmartCmd {
+	bool ok = true;
+};
+
+struct HostnameCmd {
+	std::string hostname;
+};
+
+// Alternatives are in order of StateCmdId
+typedef std::variant<std::monostate, OnlineCmd, AntivirusCmd, SmartCmd, HostnameCmd> StateCmd;
+
+StateCmdId state_cmd_id(const std::string& name);
+
+inline StateCmdId state_cmd_id(const StateCmd& cmd)
+{
+	return (StateCmdId)cmd.index();
+}
+
+// Make typed record from command value, monostate if it is not state command
+StateCmd state_cmd(const Json::Value&);
+
+// Command value as it is spread between nodes
+Json::Value state_cmd_json(const StateCmd&);
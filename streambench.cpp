@@ -0,0 +1,117 @@
+/* Throughput of encrypted compressed streams of TCP sessions with both
+ * ciphers: AES-256-CFB8 (protocol 6 and older) and AES-256-GCM records
+ * (protocol 7). Random file is written by OCCstream and read back by
+ * ICCstream, like files sent in sessions.
+ * Build: make streambench. Run: ./streambench [size in MB] [directory] */
+#include <chrono>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <json/json.h>
+#include "ccstream.h"
+#include "cryptkey.h"
+#include "tmpdir.h"
+#include "exc_error.h"
+#include "main.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::ifstream;
+using std::ofstream;
+using std::exception;
+typedef std::chrono::steady_clock Clock;
+
+ProgramStatus prog_status = ProgramStatus::work;
+ifstream rnd("/dev/urandom");
+Json::StreamWriterBuilder json_builder;
+Json::StreamWriterBuilder json_cbuilder;
+std::random_device rd;
+
+static double seconds_since(Clock::time_point start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+static bool same_files(const string& a, const string& b)
+{
+	ifstream fa(a, std::ios::binary), fb(b, std::ios::binary);
+	vector<char> ba(0x100000), bb(0x100000);
+	while (fa && fb) {
+		fa.read(ba.data(), ba.size());
+		fb.read(bb.data(), bb.size());
+		if (fa.gcount() != fb.gcount() || !std::equal(ba.begin(), ba.begin() + fa.gcount(), bb.begin()))
+			return false;
+	}
+	return fa.eof() && fb.eof();
+}
+
+static void bench(StreamCipher cipher, const CryptKey& key, const string& dir, size_t size)
+{
+	const string src = dir + "/src";
+	const string stream = dir + "/stream";
+	const string dst = dir + "/dst";
+
+	Clock::time_point start = Clock::now();
+	{
+		Fstream f = Fstream::create(stream);
+		Ostream os(f);
+		OCCstream out(os, key, cipher);
+		out.write_file(src);
+		out.close();
+		os.close();
+		f.close();
+	}
+	double write_time = seconds_since(start);
+
+	start = Clock::now();
+	{
+		Fstream f = Fstream::open(stream);
+		Istream is(f);
+		ICCstream in(is, key, cipher);
+		int fd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0)
+			throw exc_errno("Error create file", dst);
+		in.read_to_tempfile(fd);
+		close(fd);
+		in.close();
+	}
+	double read_time = seconds_since(start);
+
+	cout << (cipher == StreamCipher::gcm ? "gcm " : "cfb8") <<
+		": write " << size / write_time / 1e6 << " MB/s, read " <<
+		size / read_time / 1e6 << " MB/s" <<
+		(same_files(src, dst) ? "" : ", DATA DIFFERS") << endl;
+}
+
+int main(int argc, char ** argv)
+{
+	size_t size = (argc > 1 ? std::stoul(argv[1]) : 256) << 20;
+	TmpDir tmp(string(argc > 2 ? argv[2] : "/tmp") + "/streambench");
+	try {
+		// Random data is not compressible, so ciphers are measured, not zlib
+		{
+			ofstream f(tmp.path + "/src", std::ios::binary);
+			vector<char> buf(0x100000);
+			for (size_t done = 0; done < size; done += buf.size()) {
+				rnd.read(buf.data(), buf.size());
+				f.write(buf.data(), buf.size());
+			}
+		}
+		CryptKey key;
+		key.random(rnd);
+		cout.precision(0);
+		cout << std::fixed;
+		bench(StreamCipher::cfb8, key, tmp.path, size);
+		bench(StreamCipher::gcm, key, tmp.path, size);
+	} catch (const exception& exc) {
+		cerr << exc.what() << endl;
+		return 1;
+	}
+	return 0;
+}
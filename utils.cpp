@@ -1,5 +1,6 @@
 #include "utils.h"
 #include <unistd.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <error.h>
 #include <errno.h>
@@ -32,6 +33,7 @@ using std::string_view;
 using std::ostringstream;
 using std::unique_ptr;
 using std::initializer_list;
+using std::function;
 typedef std::lock_guard<mutex> lock;
 
 int createfile(const string& filename)
@@ -124,6 +126,53 @@ void writefile(int fd, const void * buf, size_t size, const string& filename)
 		throw exc_error();
 }
 
+void writevfile(int fd, iovec * iov, int cnt, const string& filename)
+{
+	while (cnt && prog_status == ProgramStatus::work) {
+		ssize_t x = writev(fd, iov, cnt);
+		if (x < 0) {
+			if (errno != EINTR)
+				throw exc_errno("Error write to", filename);
+			continue;
+		}
+		for (; cnt && size_t(x) >= iov->iov_len; iov++, cnt--)
+			x -= iov->iov_len;
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + x;
+			iov->iov_len -= x;
+		}
+	}
+	if (prog_status != ProgramStatus::work)
+		throw exc_error();
+}
+
+void writefile_all(int fd, const void * buf, size_t size, const string& filename)
+{
+	const char * src = (const char *)buf;
+	const char * end = src + size;
+	while (src < end) {
+		ssize_t x =  write(fd, src, end - src);
+		if (x > 0)
+			src += x;
+		else if (errno != EINTR)
+			throw exc_errno("Error write to", filename);
+	}
+}
+
+void sync_dir(const string& filename)
+{
+	string dir = filename.substr(0, filename.rfind('/') + 1);
+	if (dir.empty())
+		dir = ".";
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		throw exc_errno("Error open file", dir);
+	int x = fsync(fd);
+	close(fd);
+	if (x)
+		throw exc_errno("Error write to", dir);
+}
+
 ssize_t read_nb(int fd, void * buf, size_t size, const string& filename)
 {
 	char * dst = (char *)buf;
@@ -282,10 +331,16 @@ bool exec_prog_input(initializer_list<string> params, const string& input)
 bool exec_prog_output(vector<string>& params, string& output, const string& workdir)
 {
 	output.clear();
+	return exec_prog_output(params, [&output](const char * buf, size_t size) { output.append(buf, size); }, workdir);
+}
+
+bool exec_prog_output(vector<string>& params, const function<void(const char *, size_t)>& output, const string& workdir)
+{
 	if (!params.size())
 		return false;
 	int pip[2];
-	if (pipe(pip))
+	// Programs may be run from several threads, pipe must not leak to other children
+	if (pipe2(pip, O_CLOEXEC))
 		error(1, errno, "Error make pipe");
 	pid_t chldpid = fork();
 	if (chldpid == -1)
@@ -318,7 +373,14 @@ bool exec_prog_output(vector<string>& params, string& output, const string& work
 	for (;;) {
 		ssize_t x = read(pip[0], buf, sizeof(buf));
 		if (x > 0) {
-			output.append(buf, x);
+			try {
+				output(buf, x);
+			} catch (...) {
+				close(pip[0]);
+				kill(chldpid, SIGKILL);
+				waitpid(chldpid, nullptr, 0);
+				throw;
+			}
 			continue;
 		}
 		if (x < 0)
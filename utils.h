@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <functional>
+#include <sys/uio.h>
 #include <json/json.h>
 #include "cryptkey.h"
 
@@ -23,6 +25,16 @@ ssize_t readsome(int fd, void * buf, size_t size, const std::string& filename);
 // Write to file like write(2) but with correct signals processing
 void writefile(int fd, const void * buf, size_t size, const std::string& filename);
 
+// Same as writefile() for several buffers, iov is changed
+void writevfile(int fd, iovec * iov, int cnt, const std::string& filename);
+
+/* Same as writefile() but does not depend on program status. Used to save
+ * node state while program exits */
+void writefile_all(int fd, const void * buf, size_t size, const std::string& filename);
+
+// Sync directory containing file, so new or renamed file survives system crash
+void sync_dir(const std::string& filename);
+
 // Same as readfile() but used in non-blocking mode
 ssize_t read_nb(int fd, void * buf, size_t size, const std::string& filename);
 
@@ -55,6 +67,8 @@ bool exec_prog_input(std::initializer_list<std::string> params, const std::strin
 // Same as exec_prog, store output in 'output'
 bool exec_prog_output(std::vector<std::string>& params, std::string& output, const std::string& workdir);
 bool exec_prog_output(std::initializer_list<std::string> params, std::string& output, const std::string& workdir = "");
+// Same as exec_prog, pass output to function by parts as it is read
+bool exec_prog_output(std::vector<std::string>& params, const std::function<void(const char *, size_t)>& output, const std::string& workdir);
 
 /* Execute program. Give program access to input and output, wait untill program ends*/
 bool exec_prog_interactive(std::initializer_list<std::string> params);
@@ -72,6 +72,15 @@ bool UUID::operator==(const UUID& that) const
 	return !memcmp(uuid, that.uuid, sizeof(uuid));
 }
 
+size_t UUID::hash() const
+{
+	// Random UUIDs are well distributed already, just mix both halves
+	uint64_t a, b;
+	memcpy(&a, uuid, sizeof(a));
+	memcpy(&b, uuid + sizeof(a), sizeof(b));
+	return a ^ (b * 0x9e3779b97f4a7c15ULL);
+}
+
 UUID UUID::none()
 {
 	UUID res;
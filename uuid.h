@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <functional>
 #include <uuid/uuid.h>
 #include <json/value.h>
 
@@ -32,6 +33,14 @@ struct UUID {
 	void random(std::ifstream& dev_urandom);
 	std::strong_ordering operator<=>(const UUID&) const;
 	bool operator==(const UUID&) const;
+
+	// For hash containers
+	size_t hash() const;
 private:
 	uuid_t uuid;
 };
+
+template<>
+struct std::hash<UUID> {
+	size_t operator()(const UUID& id) const { return id.hash(); }
+};
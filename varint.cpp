@@ -0,0 +1,38 @@
+#include "varint.h"
+#include <libintl.h>
+#include "exc_error.h"
+#define _(STRING) gettext(STRING)
+
+void put_varint(std::string& s, uint64_t x)
+{
+	while (x >= 0x80) {
+		s += char(x | 0x80);
+		x >>= 7;
+	}
+	s += char(x);
+}
+
+uint64_t get_varint(const char *& p, const char * end)
+{
+	uint64_t res = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (p == end)
+			throw exc_error(_("Unexpected end of data"));
+		uint8_t b = *p++;
+		res |= uint64_t(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return res;
+	}
+	throw exc_error(_("Bad number"));
+}
+
+void put_svarint(std::string& s, int64_t x)
+{
+	put_varint(s, (uint64_t(x) << 1) ^ uint64_t(x >> 63));
+}
+
+int64_t get_svarint(const char *& p, const char * end)
+{
+	uint64_t x = get_varint(p, end);
+	return int64_t(x >> 1) ^ -int64_t(x & 1);
+}
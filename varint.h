@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+#include <cstdint>
+
+// LEB128: 7 bits per byte, high bit is set if more bytes follow
+
+void put_varint(std::string&, uint64_t);
+
+// Read number and move pointer. Throw exc_error if data is damaged
+uint64_t get_varint(const char *& p, const char * end);
+
+// Signed numbers are zigzag encoded: 0, -1, 1, -2, ... -> 0, 1, 2, 3, ...
+void put_svarint(std::string&, int64_t);
+int64_t get_svarint(const char *& p, const char * end);